@@ -0,0 +1,234 @@
+/*
+  Benchmark harness for the C simulator.  Loads each graph/rat
+  combination once, and then times repeated runs of the simulation
+  for each update mode, without process startup or file parsing.
+*/
+
+#include <string.h>
+#include <getopt.h>
+#include <math.h>
+
+#include "crun.h"
+#include "cycletimer.h"
+
+/* Graph/rat combinations, as in benchmarkList of benchmark.py */
+static struct {
+    int nnode;
+    char gtype;
+    char rtype;
+    int load_factor;
+} benchmark_list[] = {
+    {32400, 'u', 'u', 32},
+    {32400, 't', 'u', 32},
+    {32400, 'u', 'd', 32},
+    {32400, 't', 'd', 32},
+};
+
+#define NBENCHMARK (sizeof(benchmark_list) / sizeof(benchmark_list[0]))
+
+/* Update mode for each flag character */
+static char *mode_names = "rbs";
+static update_t mode_list[] = { UPDATE_RAT, UPDATE_BATCH, UPDATE_SYNCHRONOUS };
+
+typedef enum { FORMAT_CSV, FORMAT_JSON } format_t;
+
+static void usage(char *name) {
+    char *use_string = "[-d DDIR] [-n STEPS] [-w WARM] [-k ITER] [-u UPDATELIST] [-s SEED] [-t THD] [-f (c|j)]";
+    outmsg("Usage: %s %s\n", name, use_string);
+    outmsg("   -h         Print this message\n");
+    outmsg("   -d DDIR    Directory holding graph and rat files\n");
+    outmsg("   -n STEPS   Number of simulation steps in each run\n");
+    outmsg("   -w WARM    Number of warm-up runs\n");
+    outmsg("   -k ITER    Number of measured runs\n");
+    outmsg("   -u UPDT    Update modes, as string containing r, b, and/or s\n");
+    outmsg("   -s SEED    Initial RNG seed\n");
+    outmsg("   -t THD     Number of threads\n");
+    outmsg("   -f FMT     Output format: c: CSV, j: JSON\n");
+    exit(0);
+}
+
+static int compare_double(const void *a, const void *b) {
+    double da = *(const double *) a;
+    double db = *(const double *) b;
+    return da < db ? -1 : da > db ? 1 : 0;
+}
+
+/* Restore initial rat positions and recompute derived state */
+static void reset_rats(state_t *s, int *start_position) {
+    memcpy(s->rat_position, start_position, s->nrat * sizeof(int));
+    s->step = 0;
+    init_rats(s);
+    take_census(s);
+}
+
+/* Load graph & rats.  Returns NULL if files can't be read */
+static state_t *load(char *ddir, int bi, random_t global_seed) {
+    char gname[MAXLINE], rname[MAXLINE];
+    int nnode = benchmark_list[bi].nnode;
+    int lf = benchmark_list[bi].load_factor;
+    snprintf(gname, MAXLINE, "%s/g-%c%d.gph", ddir, benchmark_list[bi].gtype, nnode);
+    snprintf(rname, MAXLINE, "%s/r-%d-%c%d.rats", ddir, nnode, benchmark_list[bi].rtype, lf);
+    FILE *gfile = fopen(gname, "r");
+    if (gfile == NULL) {
+	outmsg("Couldn't open graph file %s\n", gname);
+	return NULL;
+    }
+    FILE *rfile = fopen(rname, "r");
+    if (rfile == NULL) {
+	outmsg("Couldn't open rat position file %s\n", rname);
+	fclose(gfile);
+	return NULL;
+    }
+    graph_t *g = read_graph(gfile);
+    state_t *s = g == NULL ? NULL : read_rats(g, rfile, global_seed);
+    fclose(gfile);
+    fclose(rfile);
+    return s;
+}
+
+int main(int argc, char *argv[]) {
+    char *ddir = "./data";
+    char *modes = "bs";
+    int steps = 50;
+    int nwarm = 1;
+    int niter = 5;
+    int nthread = 1;
+    random_t global_seed = DEFAULTSEED;
+    format_t format = FORMAT_CSV;
+    int c, bi, i, it;
+
+    char *optstring = "hd:n:w:k:u:s:t:f:";
+    while ((c = getopt(argc, argv, optstring)) != -1) {
+	switch(c) {
+	case 'h':
+	    usage(argv[0]);
+	    break;
+	case 'd':
+	    ddir = optarg;
+	    break;
+	case 'n':
+	    steps = atoi(optarg);
+	    break;
+	case 'w':
+	    nwarm = atoi(optarg);
+	    break;
+	case 'k':
+	    niter = atoi(optarg);
+	    break;
+	case 'u':
+	    modes = optarg;
+	    break;
+	case 's':
+	    global_seed = strtoul(optarg, NULL, 0);
+	    break;
+	case 't':
+	    nthread = atoi(optarg);
+#if !OMP
+	    if (nthread > 1)
+		outmsg("Compiled without OpenMP.  Using 1 thread\n");
+	    nthread = 1;
+#endif
+	    if (nthread < 1)
+		nthread = 1;
+	    break;
+	case 'f':
+	    if (optarg[0] == 'c')
+		format = FORMAT_CSV;
+	    else if (optarg[0] == 'j')
+		format = FORMAT_JSON;
+	    else {
+		outmsg("Invalid output format '%c'\n", optarg[0]);
+		usage(argv[0]);
+	    }
+	    break;
+	default:
+	    outmsg("Unknown option '%c'\n", c);
+	    usage(argv[0]);
+	}
+    }
+    for (i = 0; modes[i]; i++) {
+	if (modes[i] != ':' && strchr(mode_names, modes[i]) == NULL) {
+	    outmsg("Invalid update mode '%c'\n", modes[i]);
+	    usage(argv[0]);
+	}
+    }
+    if (steps < 1 || niter < 1 || nwarm < 0) {
+	outmsg("Need at least one step and one measured run\n");
+	exit(1);
+    }
+
+    double *mrps = double_alloc(niter);
+    if (mrps == NULL) {
+	outmsg("Couldn't allocate space for %d runs\n", niter);
+	exit(1);
+    }
+
+    if (format == FORMAT_CSV)
+	printf("graph,rats,mode,threads,steps,runs,min_mrps,median_mrps,max_mrps,mean_mrps,stddev_mrps\n");
+    else
+	printf("[");
+    bool first = true;
+
+    for (bi = 0; bi < NBENCHMARK; bi++) {
+	state_t *s = load(ddir, bi, global_seed);
+	if (s == NULL)
+	    exit(1);
+	s->nthread = nthread;
+	int *start_position = int_alloc(s->nrat);
+	if (start_position == NULL) {
+	    outmsg("Couldn't allocate space for %d rats\n", s->nrat);
+	    exit(1);
+	}
+	memcpy(start_position, s->rat_position, s->nrat * sizeof(int));
+
+	char gname[32], rname[32];
+	snprintf(gname, sizeof(gname), "g-%c%d", benchmark_list[bi].gtype, benchmark_list[bi].nnode);
+	snprintf(rname, sizeof(rname), "r-%d-%c%d", benchmark_list[bi].nnode,
+		 benchmark_list[bi].rtype, benchmark_list[bi].load_factor);
+
+	for (i = 0; modes[i]; i++) {
+	    char mode = modes[i];
+	    if (mode == ':')
+		continue;
+	    update_t update_mode = mode_list[strchr(mode_names, mode) - mode_names];
+
+	    for (it = 0; it < nwarm + niter; it++) {
+		reset_rats(s, start_position);
+		double start = currentSeconds();
+		simulate(s, steps, update_mode, steps, false);
+		double delta = currentSeconds() - start;
+		if (it >= nwarm)
+		    mrps[it-nwarm] = 1e-6 * (double) s->nrat * steps / delta;
+	    }
+
+	    double sum = 0.0, sumsq = 0.0;
+	    for (it = 0; it < niter; it++)
+		sum += mrps[it];
+	    double mean = sum / niter;
+	    for (it = 0; it < niter; it++)
+		sumsq += (mrps[it] - mean) * (mrps[it] - mean);
+	    double stddev = niter > 1 ? sqrt(sumsq / (niter - 1)) : 0.0;
+	    qsort(mrps, niter, sizeof(double), compare_double);
+	    double median = niter % 2 ? mrps[niter/2] : 0.5 * (mrps[niter/2-1] + mrps[niter/2]);
+
+	    outmsg("%s %s %c: median %.2f MRPS\n", gname, rname, mode, median);
+	    if (format == FORMAT_CSV)
+		printf("%s,%s,%c,%d,%d,%d,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+		       gname, rname, mode, nthread, steps, niter,
+		       mrps[0], median, mrps[niter-1], mean, stddev);
+	    else
+		printf("%s\n  {\"graph\": \"%s\", \"rats\": \"%s\", \"mode\": \"%c\", \"threads\": %d, "
+		       "\"steps\": %d, \"runs\": %d, \"min_mrps\": %.3f, \"median_mrps\": %.3f, "
+		       "\"max_mrps\": %.3f, \"mean_mrps\": %.3f, \"stddev_mrps\": %.3f}",
+		       first ? "" : ",", gname, rname, mode, nthread, steps, niter,
+		       mrps[0], median, mrps[niter-1], mean, stddev);
+	    first = false;
+	    fflush(stdout);
+	}
+	free(start_position);
+    }
+    if (format == FORMAT_JSON)
+	printf("\n]\n");
+    free(mrps);
+    return 0;
+}
@@ -11,10 +11,11 @@ import socket
 import random
 
 import grade
+import rutil
 
 def usage(fname):
     ustring = "Usage: %s [-h] [-a (x|o|n)] [-s SCALE] [-u UPDATELIST] [-f OUTFILE]" % fname
-    ustring += "[-c] [-p PROCESSLIMIT]"
+    ustring += "[-c [-H]] [-p PROCESSLIMIT] [-t THREADS]"
     print ustring 
     print "(All lists given as colon-separated text.)"
     print "    -h              Print this message"
@@ -27,8 +28,12 @@ def usage(fname):
     print "    -f OUTFILE      Create output file recording measurements"
     print "         If file name contains field of form XX..X, will replace with ID having that many digits"
     print "    -c            Compare simulator output to recorded result"
+    print "    -H            With -c, compare only per-step hashes of the rat counts"
     print "    -p PROCESSLIMIT Specify upper limit on number of MPI processes"
     print "       If > 1, will run crun-mpi.  Else will run crun"
+    print "    -t THREADS      Run hybrid: each MPI process has THREADS threads, and the"
+    print "       process count is divided by THREADS (e.g., one process per socket)."
+    print "       Parallel runs then use all PROCESSLIMIT cores, even beyond one machine"
     sys.exit(0)
 
 # Enumerated type for update mode:
@@ -46,6 +51,8 @@ dataDirectory = "./data/"
 outFile = None
 captureDirectory = "./capture"
 doCheck = False
+# Have simulator print state hashes, rather than full output, when checking
+hashCheck = False
 
 # How many mismatched lines warrant detailed report
 mismatchLimit = 5
@@ -56,6 +63,19 @@ mpiCmd = ["mpirun"]
 newMpiFlags = ["-map-by", "core", "-bind-to", "core"]
 oldMpiFlags = ["-bycore", "-bind-to-core"]
 
+# Threads per MPI process in hybrid runs
+threadCount = 1
+# Cores used by parallel hybrid runs, which can span several machines.  Set by -p
+hybridCores = 0
+
+# Give each hybrid process a block of cores on one socket
+def hybridMpiFlags(mpiFlags):
+    if mpiFlags == newMpiFlags:
+        return ["-map-by", "socket:PE=%d" % threadCount, "-bind-to", "core"]
+    elif mpiFlags == oldMpiFlags:
+        return ["-bysocket", "-cpus-per-proc", str(threadCount), "-bind-to-core"]
+    return mpiFlags
+
 # Dictionary of geometric means, indexed by (mode, threads)
 gmeanDict = {}
 
@@ -172,6 +192,20 @@ def checkOutputs(captureFile, outputFile):
         outmsg("Simulator output matches recorded results!")
     return badLines == 0
 
+# Compare hashes printed by simulator to those of the recorded counts
+def checkHashes(captureFile, outputFile):
+    if captureFile == None or outputFile == None:
+        return True
+    refHashes = rutil.readCountHashes(captureFile)
+    captureFile.close()
+    testHashes = rutil.readHashLines(outputFile)
+    step = rutil.firstHashMismatch(refHashes, testHashes)
+    if step is not None:
+        outmsg("Mismatch at step %d.  Hash of rat counts differs from recorded result" % step)
+        return False
+    outmsg("Simulator hashes match recorded results for %d steps!" % len(refHashes))
+    return True
+
 
 def cmd(graphSize, graphType, ratType, loadFactor, stepCount, updateType, processCount, mpiFlags, otherArgs = []):
     global bcount, logSum
@@ -190,10 +224,17 @@ def cmd(graphSize, graphType, ratType, loadFactor, stepCount, updateType, proces
     ok = True
     if recordOutput:
         clist = captureRunFlags + ["-g", graphFileName, "-r", ratFileName, "-u", updateFlag, "-n", str(stepCount), "-i", str(stepCount)] + otherArgs
+        if hashCheck:
+            clist += ["-f", "h"]
     else:
         clist = runFlags + ["-g", graphFileName, "-r", ratFileName, "-u", updateFlag, "-n", str(stepCount), "-i", str(stepCount)] + otherArgs
-    if processCount > 1:
-        gcmd = mpiCmd + mpiFlags + ["-np", str(processCount), mpiSimProg] + clist
+    # Process count gives total cores.  Hybrid runs divide them into threads
+    rankCount = max(1, processCount / threadCount)
+    if processCount > 1 and threadCount > 1:
+        clist += ["-t", str(threadCount)]
+        mpiFlags = hybridMpiFlags(mpiFlags)
+    if rankCount > 1:
+        gcmd = mpiCmd + mpiFlags + ["-np", str(rankCount), mpiSimProg] + clist
     else:
         gcmd = [simProg] + clist
     gcmdLine = " ".join(gcmd)
@@ -202,7 +243,10 @@ def cmd(graphSize, graphType, ratType, loadFactor, stepCount, updateType, proces
     try:
         if recordOutput:
             simProcess = subprocess.Popen(gcmd, stderr = subprocess.PIPE, stdout = subprocess.PIPE)
-            ok = ok and checkOutputs(checkFile, simProcess.stdout)
+            if hashCheck:
+                ok = ok and checkHashes(checkFile, simProcess.stdout)
+            else:
+                ok = ok and checkOutputs(checkFile, simProcess.stdout)
             # Echo any results printed by simulator on stderr onto stdout
             for line in simProcess.stderr:
                 sys.stdout.write(line)
@@ -249,6 +293,8 @@ def sweep(updateType, processLimit, scale, mpiFlags, otherArgs):
             continue
         if processCount > processLimit:
             processCount = processLimit
+        elif processCount > 1 and threadCount > 1 and hybridCores > processCount:
+            processCount = hybridCores
         outmsg("\tNodes\tgtype\tlf\trtype\tsteps\tupdate\tprocs\tsecs\tMRPS")
         stepCount = stepCount / scale
         outmsg(nomarker + "---------" * 8)
@@ -287,10 +333,10 @@ def generateFileName(template):
     return "".join(ls)
 
 def run(name, args):
-    global outFile, doCheck
+    global outFile, doCheck, hashCheck, threadCount, hybridCores
     scale = 1
     updateList = [UpdateMode.batch, UpdateMode.synchronous]
-    optString = "ha:s:u:p:f:c"
+    optString = "ha:s:u:p:f:cHt:"
     processLimit = 100
     otherArgs = []
     mpiFlags = []
@@ -333,8 +379,13 @@ def run(name, args):
                     usage(name)
         elif opt == '-c':
             doCheck = True
+        elif opt == '-H':
+            hashCheck = True
         elif opt == '-p':
             processLimit = int(val)
+            hybridCores = processLimit
+        elif opt == '-t':
+            threadCount = max(1, int(val))
         else:
             outmsg("Unknown option '%s'" % opt)
             usage(name)
@@ -0,0 +1,185 @@
+/*
+  Checkpointing of simulation state.  A checkpoint holds everything
+  needed to continue a simulation: the rat positions & seeds, the
+  number of steps taken, and the update parameters.  Checkpoints are
+  written on a separate thread, from a copy of the state.
+*/
+
+#include <pthread.h>
+
+#include "crun.h"
+
+/*
+  File format: 64-byte header, then rat_position (R 32-bit ints,
+  using the numbering from the graph file), then rat_seed (R 32-bit ints)
+*/
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    int32_t nnode;
+    int32_t nedge;
+    int32_t nrat;
+    int32_t step;
+    int32_t update_mode;
+    int32_t batch_size;
+    uint64_t fingerprint;  /* From graph_fingerprint() */
+    char pad[BINARY_ALIGN - 8 * sizeof(int32_t) - sizeof(uint64_t)];
+} checkpoint_header_t;
+
+struct checkpointer {
+    char *fname;
+    /* Set while a checkpoint is being written */
+    bool busy;
+    pthread_t thread;
+    /* Copy of state being written */
+    checkpoint_header_t h;
+    int *rat_position;
+    random_t *rat_seed;
+};
+
+/* Write copied state to temporary file, and then move it into place */
+static void *checkpoint_thread(void *arg) {
+    struct checkpointer *c = (struct checkpointer *) arg;
+    char tname[MAXLINE];
+    int nrat = c->h.nrat;
+    snprintf(tname, MAXLINE, "%s.tmp", c->fname);
+    FILE *outfile = fopen(tname, "w");
+    bool ok = outfile != NULL;
+    ok = ok && fwrite(&c->h, sizeof(c->h), 1, outfile) == 1;
+    ok = ok && fwrite(c->rat_position, sizeof(int), nrat, outfile) == (size_t) nrat;
+    ok = ok && fwrite(c->rat_seed, sizeof(random_t), nrat, outfile) == (size_t) nrat;
+    if (outfile != NULL && fclose(outfile) != 0)
+	ok = false;
+    if (ok && rename(tname, c->fname) != 0)
+	ok = false;
+    if (!ok)
+	outmsg("WARNING: Couldn't write checkpoint file %s\n", c->fname);
+    return NULL;
+}
+
+/* Wait for checkpoint being written to finish */
+static void wait_checkpoint(struct checkpointer *c) {
+    if (c->busy) {
+	pthread_join(c->thread, NULL);
+	c->busy = false;
+    }
+}
+
+/* Set up checkpointing to named file.  Returns NULL on failure */
+struct checkpointer *new_checkpointer(state_t *s, char *fname) {
+    struct checkpointer *c = malloc(sizeof(struct checkpointer));
+    if (c == NULL) {
+	outmsg("Couldn't allocate storage for checkpoints\n");
+	return NULL;
+    }
+    c->fname = fname;
+    c->busy = false;
+    c->rat_position = int_alloc(s->nrat);
+    c->rat_seed = calloc(s->nrat, sizeof(random_t));
+    if (c->rat_position == NULL || c->rat_seed == NULL) {
+	outmsg("Couldn't allocate space for checkpointing %d rats\n", s->nrat);
+	free(c->rat_position);
+	free(c->rat_seed);
+	free(c);
+	return NULL;
+    }
+    memset(&c->h, 0, sizeof(c->h));
+    c->h.magic = CHECKPOINT_MAGIC;
+    c->h.version = BINARY_VERSION;
+    c->h.nnode = s->g->nnode;
+    c->h.nedge = s->g->nedge;
+    c->h.nrat = s->nrat;
+    c->h.fingerprint = graph_fingerprint(s->g);
+    return c;
+}
+
+/*
+  Start writing checkpoint of the current state.  Waits for the
+  previous checkpoint to finish first.  Called only by the master
+ */
+void write_checkpoint(state_t *s) {
+    struct checkpointer *c = s->checkpointer;
+    int *node_order = s->g->node_order;
+    int ri;
+
+    wait_checkpoint(c);
+    c->h.step = s->step;
+    c->h.update_mode = s->update_mode;
+    c->h.batch_size = s->batch_size;
+    if (node_order == NULL)
+	memcpy(c->rat_position, s->rat_position, s->nrat * sizeof(int));
+    else {
+	for (ri = 0; ri < s->nrat; ri++)
+	    c->rat_position[ri] = node_order[s->rat_position[ri]];
+    }
+    memcpy(c->rat_seed, s->rat_seed, s->nrat * sizeof(random_t));
+
+    if (pthread_create(&c->thread, NULL, checkpoint_thread, c) == 0)
+	c->busy = true;
+    else
+	checkpoint_thread(c);
+}
+
+/* Wait for last checkpoint to be written, and free storage */
+void free_checkpointer(struct checkpointer *c) {
+    wait_checkpoint(c);
+    free(c->rat_position);
+    free(c->rat_seed);
+    free(c);
+}
+
+/*
+  Read checkpoint for graph and initialize simulation state from it.
+  Rat positions use the numbering from the graph file.  Returns NULL
+  on failure
+ */
+state_t *read_checkpoint(graph_t *g, FILE *infile, random_t global_seed) {
+    checkpoint_header_t h;
+    int ri;
+
+    if (fread(&h, sizeof(h), 1, infile) != 1 || h.magic != CHECKPOINT_MAGIC) {
+	outmsg("ERROR. Not a checkpoint file\n");
+	return NULL;
+    }
+    if (h.version != BINARY_VERSION) {
+	outmsg("ERROR. Checkpoint file has version %u.  Expected %u\n", h.version, BINARY_VERSION);
+	return NULL;
+    }
+    if (h.nnode != g->nnode || h.nedge != g->nedge || h.fingerprint != graph_fingerprint(g)) {
+	outmsg("ERROR. Checkpoint was taken with a different graph\n");
+	return NULL;
+    }
+    if (h.step < 0 || h.nrat < 0 || h.batch_size < 1 ||
+	h.update_mode < UPDATE_SYNCHRONOUS || h.update_mode > UPDATE_RAT) {
+	outmsg("ERROR. Malformed checkpoint header\n");
+	return NULL;
+    }
+    state_t *s = new_rats(g, h.nrat, global_seed);
+    if (s == NULL)
+	return NULL;
+    if (fread(s->rat_position, sizeof(int), s->nrat, infile) != (size_t) s->nrat) {
+	outmsg("ERROR. Checkpoint file truncated\n");
+	free_rats(s);
+	return NULL;
+    }
+    for (ri = 0; ri < s->nrat; ri++) {
+	int nid = s->rat_position[ri];
+	if (nid < 0 || nid >= g->nnode) {
+	    outmsg("ERROR.  Rat %d.  Invalid node number %d\n", ri, nid);
+	    free_rats(s);
+	    return NULL;
+	}
+    }
+    init_rats(s);
+    /* Seeds have advanced since they were initialized */
+    if (fread(s->rat_seed, sizeof(random_t), s->nrat, infile) != (size_t) s->nrat) {
+	outmsg("ERROR. Checkpoint file truncated\n");
+	free_rats(s);
+	return NULL;
+    }
+    s->step = h.step;
+    s->update_mode = h.update_mode;
+    s->batch_size = h.batch_size;
+    outmsg("Resuming %d rats after step %d\n", s->nrat, s->step);
+    return s;
+}
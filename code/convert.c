@@ -0,0 +1,91 @@
+/* Convert graph and rat files into binary format that crun can map directly */
+
+#include <string.h>
+#include <getopt.h>
+
+#include "crun.h"
+
+static void usage(char *name) {
+    char *use_string = "-g GFILE [-G BGFILE] [-r RFILE -R BRFILE]";
+    outmsg("Usage: %s %s\n", name, use_string);
+    outmsg("   -h         Print this message\n");
+    outmsg("   -g GFILE   Graph file (text or binary)\n");
+    outmsg("   -G BGFILE  Binary graph file to write\n");
+    outmsg("   -r RFILE   Rat position file (text or binary)\n");
+    outmsg("   -R BRFILE  Binary rat position file to write\n");
+    exit(0);
+}
+
+static FILE *open_file(char *name, char *mode) {
+    FILE *f = fopen(name, mode);
+    if (f == NULL) {
+	outmsg("Couldn't open file %s\n", name);
+	exit(1);
+    }
+    return f;
+}
+
+int main(int argc, char *argv[]) {
+    FILE *gfile = NULL;
+    FILE *rfile = NULL;
+    char *bgname = NULL;
+    char *brname = NULL;
+    int c;
+
+    char *optstring = "hg:G:r:R:";
+    while ((c = getopt(argc, argv, optstring)) != -1) {
+	switch(c) {
+	case 'h':
+	    usage(argv[0]);
+	    break;
+	case 'g':
+	    gfile = open_file(optarg, "r");
+	    break;
+	case 'G':
+	    bgname = optarg;
+	    break;
+	case 'r':
+	    rfile = open_file(optarg, "r");
+	    break;
+	case 'R':
+	    brname = optarg;
+	    break;
+	default:
+	    outmsg("Unknown option '%c'\n", c);
+	    usage(argv[0]);
+	}
+    }
+    if (gfile == NULL) {
+	outmsg("Need graph file\n");
+	usage(argv[0]);
+    }
+    if ((rfile == NULL) != (brname == NULL)) {
+	outmsg("Need both input and output rat files\n");
+	usage(argv[0]);
+    }
+
+    graph_t *g = read_graph(gfile);
+    if (g == NULL)
+	exit(1);
+    if (bgname != NULL) {
+	FILE *bgfile = open_file(bgname, "w");
+	if (!write_graph(g, bgfile) || fclose(bgfile) != 0) {
+	    outmsg("Couldn't write binary graph file %s\n", bgname);
+	    exit(1);
+	}
+	outmsg("Wrote binary graph file %s\n", bgname);
+    }
+
+    if (rfile != NULL) {
+	state_t *s = read_rats(g, rfile, DEFAULTSEED);
+	if (s == NULL)
+	    exit(1);
+	FILE *brfile = open_file(brname, "w");
+	if (!write_rats(s, brfile) || fclose(brfile) != 0) {
+	    outmsg("Couldn't write binary rat file %s\n", brname);
+	    exit(1);
+	}
+	outmsg("Wrote binary rat file %s\n", brname);
+    }
+    return 0;
+}
@@ -10,7 +10,7 @@
 
 
 static void usage(char *name) {
-    char *use_string = "-g GFILE -r RFILE [-n STEPS] [-s SEED] [-u (r|b|s)] [-q] [-i INT]";
+    char *use_string = "-g GFILE -r RFILE [-n STEPS] [-s SEED] [-u (r|b|s)] [-q] [-i INT] [-t THD] [-o (n|r|h)] [-f (t|b|d|h|H)] [-w DEPTH] [-P PFILE] [-c CFILE [-k INT]] [-C CFILE] [-m (n|r)] [-b INT] [-a (f|i)] [-e RUNS]";
     outmsg("Usage: %s %s\n", name, use_string);
     outmsg("   -h        Print this message\n");
     outmsg("   -g GFILE  Graph file\n");
@@ -23,6 +23,31 @@ static void usage(char *name) {
     outmsg("             b: Batched.      Repeatedly compute states for small batches of rats and then update\n");
     outmsg("   -q        Operate in quiet mode.  Do not generate simulation results\n");
     outmsg("   -i INT    Display update interval\n");
+    outmsg("   -t THD    Number of threads\n");
+    outmsg("   -o ORDER  Renumber nodes to improve locality:\n");
+    outmsg("             n: None.     Keep numbering from graph file\n");
+    outmsg("             r: RCM.      Reverse Cuthill-McKee ordering\n");
+    outmsg("             h: Hilbert.  Order grid along Hilbert curve\n");
+    outmsg("   -f FMT    Output format:\n");
+    outmsg("             t: Text.    Readable by grun.py\n");
+    outmsg("             b: Binary.  Compact stream of 32-bit ints\n");
+    outmsg("             d: Delta.   Text, with only changed counts between keyframes\n");
+    outmsg("             h: Hash.    One hash of the rat counts per step\n");
+    outmsg("             H: Hash.    Hashes of the rat counts & positions per step\n");
+    outmsg("   -w DEPTH  Frames buffered for output before simulation waits (default %d)\n", OUTPUT_DEPTH);
+    outmsg("   -P PFILE  Write phase timings as JSON (build with PROFILE=1)\n");
+    outmsg("   -c CFILE  Write checkpoint file after last step\n");
+    outmsg("   -k INT    Also write checkpoint every INT steps\n");
+    outmsg("   -C CFILE  Resume from checkpoint file, instead of initial rat positions\n");
+    outmsg("   -m PART   Division of work among MPI processes:\n");
+    outmsg("             n: Nodes.  Each process moves the rats in a block of rows\n");
+    outmsg("             r: Rats.   Each process moves a slice of every batch\n");
+    outmsg("   -b INT    Steps between rebalancing blocks of nodes (0 = never)\n");
+    outmsg("   -a PLACE  Placement of large arrays on NUMA nodes:\n");
+    outmsg("             f: First touch.  On node of thread first writing each page\n");
+    outmsg("             i: Interleave.   Spread pages across all nodes\n");
+    outmsg("   -e RUNS   Ensemble of RUNS simulations with seeds SEED, SEED+1, ..., sharing the graph.\n");
+    outmsg("             Prints final hash of each run and statistics\n");
     done();
     exit(0);
 }
@@ -30,25 +55,42 @@ static void usage(char *name) {
 int main(int argc, char *argv[]) {
     FILE *gfile = NULL;
     FILE *rfile = NULL;
+    FILE *cfile = NULL;
+    char *checkpoint_name = NULL;
+    int checkpoint_interval = 0;
+    bool resume = false;
     int steps = 1;
     int dinterval = 1;
     random_t global_seed = DEFAULTSEED;
     update_t update_mode = UPDATE_BATCH;
+    bool update_given = false;
+    order_t order = ORDER_NONE;
+    partition_t partition = PARTITION_NODES;
+    int rebalance_interval = REBALANCE_INTERVAL;
+    output_t format = OUTPUT_TEXT;
+    int output_depth = OUTPUT_DEPTH;
+    int nrun = 0;
+#if PROFILE
+    char *profile_name = "profile.json";
+#endif
     int process_count = 1;
     int process_id = 0;
+    int thread_count = 1;
     int c;
     graph_t *g = NULL;
     state_t *s = NULL;
     bool display = true;
 
 #if MPI
-    MPI_Init(NULL, NULL);
+    /* Threads in each process leave the messages to the master thread */
+    int thread_support = MPI_THREAD_SINGLE;
+    MPI_Init_thread(NULL, NULL, MPI_THREAD_FUNNELED, &thread_support);
     MPI_Comm_size(MPI_COMM_WORLD, &process_count);
     MPI_Comm_rank(MPI_COMM_WORLD, &process_id);
 #endif
 
     bool mpi_master = process_id == 0;
-    char *optstring = "hg:r:R:n:s:u:i:q";
+    char *optstring = "hg:r:R:n:s:u:i:qt:o:f:P:c:k:C:m:b:a:w:e:";
     while ((c = getopt(argc, argv, optstring)) != -1) {
 	switch(c) {
 	case 'h':
@@ -93,6 +135,7 @@ int main(int argc, char *argv[]) {
 		done();
 		exit(1);
 	    }
+	    update_given = true;
 	    break;
 	case 'q':
 	    display = false;
@@ -100,6 +143,124 @@ int main(int argc, char *argv[]) {
 	case 'i':
 	    dinterval = atoi(optarg);
 	    break;
+	case 't':
+	    thread_count = atoi(optarg);
+#if !OMP
+	    if (thread_count > 1 && mpi_master)
+		outmsg("Compiled without OpenMP.  Using 1 thread\n");
+	    thread_count = 1;
+#endif
+	    if (thread_count < 1)
+		thread_count = 1;
+	    break;
+	case 'o':
+	    if (optarg[0] == 'n')
+		order = ORDER_NONE;
+	    else if (optarg[0] == 'r')
+		order = ORDER_RCM;
+	    else if (optarg[0] == 'h')
+		order = ORDER_HILBERT;
+	    else {
+		if (!mpi_master) exit(1);
+		outmsg("Invalid ordering '%c'\n", optarg[0]);
+		usage(argv[0]);
+		done();
+		exit(1);
+	    }
+	    break;
+	case 'f':
+	    if (optarg[0] == 't')
+		format = OUTPUT_TEXT;
+	    else if (optarg[0] == 'b')
+		format = OUTPUT_BINARY;
+	    else if (optarg[0] == 'd')
+		format = OUTPUT_DELTA;
+	    else if (optarg[0] == 'h')
+		format = OUTPUT_HASH;
+	    else if (optarg[0] == 'H')
+		format = OUTPUT_HASH_RATS;
+	    else {
+		if (!mpi_master) exit(1);
+		outmsg("Invalid output format '%c'\n", optarg[0]);
+		usage(argv[0]);
+		done();
+		exit(1);
+	    }
+	    break;
+	case 'P':
+#if PROFILE
+	    profile_name = optarg;
+#else
+	    if (mpi_master)
+		outmsg("Compiled without profiling.  No phase timings\n");
+#endif
+	    break;
+	case 'c':
+	    checkpoint_name = optarg;
+	    break;
+	case 'k':
+	    checkpoint_interval = atoi(optarg);
+	    break;
+	case 'C':
+	    if (!mpi_master) break;
+	    cfile = fopen(optarg, "r");
+	    if (cfile == NULL) {
+		outmsg("Couldn't open checkpoint file %s\n", optarg);
+		done();
+		exit(1);
+	    }
+	    break;
+	case 'm':
+	    if (optarg[0] == 'n')
+		partition = PARTITION_NODES;
+	    else if (optarg[0] == 'r')
+		partition = PARTITION_RATS;
+	    else {
+		if (!mpi_master) exit(1);
+		outmsg("Invalid partitioning '%c'\n", optarg[0]);
+		usage(argv[0]);
+		done();
+		exit(1);
+	    }
+#if !MPI
+	    if (mpi_master)
+		outmsg("Compiled without MPI.  Ignoring partitioning\n");
+#endif
+	    break;
+	case 'b':
+	    rebalance_interval = atoi(optarg);
+	    break;
+	case 'w':
+	    output_depth = atoi(optarg);
+	    if (output_depth < 1) {
+		if (!mpi_master) exit(1);
+		outmsg("Invalid output depth %d\n", output_depth);
+		usage(argv[0]);
+		done();
+		exit(1);
+	    }
+	    break;
+	case 'e':
+	    nrun = atoi(optarg);
+	    if (nrun < 1) {
+		if (!mpi_master) exit(1);
+		outmsg("Invalid number of runs %d\n", nrun);
+		usage(argv[0]);
+		done();
+		exit(1);
+	    }
+	    break;
+	case 'a':
+	    if (optarg[0] == 'i')
+		set_interleave(true);
+	    else if (optarg[0] != 'f') {
+		if (!mpi_master) exit(1);
+		outmsg("Invalid placement '%c'\n", optarg[0]);
+		usage(argv[0]);
+		done();
+		exit(1);
+	    }
+	    break;
 	default:
 	    if (!mpi_master) break;
 	    outmsg("Unknown option '%c'\n", c);
@@ -108,22 +269,41 @@ int main(int argc, char *argv[]) {
 	    exit(1);
 	}
     }
+#if MPI
+    if (thread_count > 1 && thread_support < MPI_THREAD_FUNNELED) {
+        if (mpi_master)
+            outmsg("MPI library doesn't support threads.  Using 1 thread per process\n");
+        thread_count = 1;
+    }
+#endif
     if (mpi_master) {
         if (gfile == NULL) {
             outmsg("Need graph file\n");
             usage(argv[0]);
         }
-        if (rfile == NULL) {
+        if (rfile == NULL && cfile == NULL) {
             outmsg("Need initial rat position file\n");
             usage(argv[0]);
         }
+        if (nrun > 0 && (cfile != NULL || checkpoint_name != NULL || process_count > 1)) {
+            outmsg("Ensembles run in a single process, without checkpoints\n");
+            done();
+            exit(1);
+        }
 
         g = read_graph(gfile);
         if (g == NULL) {
             done();
             exit(1);
         }
-        s = read_rats(g, rfile, global_seed);
+        resume = cfile != NULL;
+        if (resume) {
+            s = read_checkpoint(g, cfile, global_seed);
+            /* Continue in same mode, unless told otherwise */
+            if (s != NULL && !update_given)
+                update_mode = s->update_mode;
+        } else
+            s = read_rats(g, rfile, global_seed);
         if (s == NULL) {
             done();
             exit(1);
@@ -131,6 +311,15 @@ int main(int argc, char *argv[]) {
 
         s->nprocess = process_count;
         s->process_id = process_id;
+        s->nthread = thread_count;
+        s->output_format = format;
+
+        /* Partitioning among processes relies on the original row-major numbering */
+        if (order != ORDER_NONE && process_count > 1) {
+            outmsg("WARNING: Node renumbering not supported with multiple processes\n");
+        } else if (reorder_graph(g, order)) {
+            reorder_rats(s);
+        }
 
         take_census(s);
         /* The master should distribute the graph & the rats to the other nodes */
@@ -141,8 +330,14 @@ int main(int argc, char *argv[]) {
         vars->tile_max = g->tile_max;
         vars->nrat = s->nrat;
         vars->global_seed = s->global_seed;
+        vars->resume = resume;
+        vars->step = s->step;
+        vars->update_mode = update_mode;
+        vars->batch_size = s->batch_size;
 
         MPI_Bcast(vars, sizeof(init_vars), MPI_CHAR, 0, MPI_COMM_WORLD);
+        if (process_count > 1)
+            distribute_graph(g, g->nnode, g->nedge, g->tile_max);
 #endif
     }
     else
@@ -151,24 +346,29 @@ int main(int argc, char *argv[]) {
         void* vars = malloc(sizeof(init_vars));
         MPI_Bcast(vars, sizeof(init_vars), MPI_CHAR, 0, MPI_COMM_WORLD);
         init_vars* V = (init_vars*)vars;
-        g = new_graph(V->nnode, V->nedge, V->tile_max);
+        g = distribute_graph(NULL, V->nnode, V->nedge, V->tile_max);
         s = new_rats(g, V->nrat, V->global_seed);
+        resume = V->resume;
+        s->step = V->step;
+        s->batch_size = V->batch_size;
+        update_mode = V->update_mode;
         s->process_id = process_id;
         s->nprocess = process_count;
+        s->nthread = thread_count;
+        s->output_format = format;
 #endif
     }
 
 #if MPI
-    //RATS
+    //RATS.  Seeds, weights & counts are recomputed by each process
     MPI_Bcast(s->rat_position, s->nrat, MPI_INT, 0, MPI_COMM_WORLD);
-    MPI_Bcast(s->rat_seed, s->nrat, MPI_INT, 0, MPI_COMM_WORLD);
-    MPI_Bcast(s->rat_count, g->nnode, MPI_INT, 0, MPI_COMM_WORLD);
-    MPI_Bcast(s->pre_computed, s->nrat, MPI_INT, 0, MPI_COMM_WORLD);
-
-    //GRAPH
-    MPI_Bcast(g->neighbor, g->nnode + g->nedge, MPI_INT, 0, MPI_COMM_WORLD);
-    MPI_Bcast(g->gsums, g->nnode + g->nedge, MPI_INT, 0, MPI_COMM_WORLD);
-    MPI_Bcast(g->neighbor_start, g->nedge, MPI_INT, 0, MPI_COMM_WORLD);
+    if (!mpi_master) {
+        init_rats(s);
+        take_census(s);
+    }
+    //Seeds have advanced in resumed simulation
+    if (resume)
+        MPI_Bcast(s->rat_seed, s->nrat, MPI_UINT32_T, 0, MPI_COMM_WORLD);
 
     MPI_Barrier(MPI_COMM_WORLD);
 #endif
@@ -177,16 +377,34 @@ int main(int argc, char *argv[]) {
     show_graph(g);
 #endif
 
+    s->partition = partition;
+    s->rebalance_interval = rebalance_interval;
+    s->output_depth = output_depth;
+    s->checkpoint_name = checkpoint_name;
+    s->checkpoint_interval = checkpoint_interval;
+
+    int first_step = s->step;
     double start = currentSeconds();
 
-    simulate(s, steps, update_mode, dinterval, display);
+    if (nrun > 0)
+        run_ensemble(s, nrun, steps, update_mode, display);
+    else
+        simulate(s, steps, update_mode, dinterval, display);
 
     double delta = currentSeconds() - start;
 
     if (mpi_master) {
-        outmsg("%d steps, %d rats, %.3f seconds\n", steps, s->nrat, delta);
+        if (nrun > 0)
+            outmsg("%d runs of %d steps, %d rats, %.3f seconds\n", nrun, s->step - first_step, s->nrat, delta);
+        else
+            outmsg("%d steps, %d rats, %.3f seconds\n", s->step - first_step, s->nrat, delta);
+        report_memory();
     }
+#if PROFILE
+    write_profile(s, profile_name);
+#endif
 #if MPI
+    free_graph_window();
     MPI_Finalize();
 #endif    
     return 0;
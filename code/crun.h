@@ -5,6 +5,11 @@
 #define MPI 0
 #endif
 
+/* Defining variable OMP enables use of OpenMP threads */
+#ifndef OMP
+#define OMP 0
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -17,12 +22,20 @@
 #include <mpi.h>
 #endif
 
+#if OMP
+#include <omp.h>
+#endif
 
 /* Optionally enable debugging routines */
 #ifndef DEBUG
 #define DEBUG 0
 #endif
 
+/* Optionally measure time spent in each phase of the simulation */
+#ifndef PROFILE
+#define PROFILE 0
+#endif
+
 #include "rutil.h"
 #include "cycletimer.h"
 
@@ -37,10 +50,95 @@
 /* What is the batch size as a fraction of the number of rats */
 #define BATCH_FRACTION 0.02
 
+/* Number of random values drawn at a time */
+#define RNG_CHUNK 1024
+
+/* Smallest batch worth splitting among threads */
+#define THREAD_MIN_BATCH 256
+
+/* Number of chunks per thread in work-stealing loops */
+#define STEAL_CHUNKS 16
+
+/* Rebuild all of gsums once more than 1/DIRTY_LIMIT of the nodes change */
+#define DIRTY_LIMIT 4
+
+/* Default number of output frames buffered ahead of the writer thread */
+#define OUTPUT_DEPTH 4
+
+/* Graphs with at most this many nodes hold their adjacency lists as 16-bit node Ids */
+#define NARROW_NODE_LIMIT 65536
+
+/* Default number of steps between checks of the MPI load balance */
+#define REBALANCE_INTERVAL 20
+
+/* Move block boundaries once a block has this much more than its share of the work */
+#define REBALANCE_THRESHOLD 1.1
+
+
+/*
+  Binary graph & rat files.  These start with a header, followed by
+  arrays of 32-bit ints, each starting on a BINARY_ALIGN byte boundary,
+  so that they can be memory-mapped and used in place.
+  Graph file: header, neighbor_start (N+1), neighbor (N+M, self edges included)
+  Rat file:   header, rat_position (R)
+ */
+#define GRAPH_MAGIC 0x48505247  /* "GRPH" */
+#define RATS_MAGIC  0x53544152  /* "RATS" */
+#define CHECKPOINT_MAGIC 0x54504B43  /* "CKPT" */
+#define BINARY_VERSION 1
+#define BINARY_ALIGN 64
+#define BINARY_ROUND(n) (((n) + BINARY_ALIGN - 1) & ~((size_t) BINARY_ALIGN - 1))
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    int32_t nnode;
+    int32_t nedge;     /* Graph files only */
+    int32_t tile_max;  /* Graph files only */
+    int32_t nrat;      /* Rat files only */
+    char pad[BINARY_ALIGN - 6 * sizeof(int32_t)];
+} binary_header_t;
 
 /* Update modes */
 typedef enum { UPDATE_SYNCHRONOUS, UPDATE_BATCH, UPDATE_RAT } update_t;
 
+/* Format of simulation output */
+/*
+  Delta format is text, with only the changed counts between keyframes.
+  Hash formats print only a hash of the state after each step
+*/
+typedef enum { OUTPUT_TEXT, OUTPUT_BINARY, OUTPUT_DELTA, OUTPUT_HASH, OUTPUT_HASH_RATS } output_t;
+
+/* Division of work among MPI processes */
+typedef enum { PARTITION_NODES, PARTITION_RATS } partition_t;
+
+/* Node renumbering applied at load time */
+typedef enum { ORDER_NONE, ORDER_RCM, ORDER_HILBERT } order_t;
+
+/* Simulation phases timed when PROFILE is enabled */
+typedef enum { PHASE_CENSUS, PHASE_GSUMS, PHASE_MOVE, PHASE_COMMIT, PHASE_OUTPUT, PHASE_COMM, NPHASE } phase_t;
+
+/* Cycle counts & calls for each phase.  One per thread, on separate cache lines */
+typedef struct {
+    uint64_t ticks[NPHASE];
+    uint64_t calls[NPHASE];
+} __attribute__((aligned(64))) profile_t;
+
+/* Work-stealing deque of chunk indices, packed as (head, tail).  On its own cache line */
+typedef struct {
+    uint64_t range;
+} __attribute__((aligned(64))) deque_t;
+
+/* Work-stealing scheduler for threaded loops */
+typedef struct sched {
+    int nthread;
+    /* Chunk c covers indices [chunk_start[c], chunk_start[c+1]).  Length = T*STEAL_CHUNKS+1 */
+    int nchunk;
+    int *chunk_start;
+    /* Chunks remaining for each thread.  Length = T */
+    deque_t *deque;
+} sched_t;
+
 /* All information needed for graphrat simulation */
 
 /* Parameter abbreviations
@@ -58,6 +156,11 @@ typedef struct {
     int tile_max;
     int nrat;
     random_t global_seed;
+    /* Set when resuming from checkpoint */
+    bool resume;
+    int step;
+    update_t update_mode;
+    int batch_size;
 } init_vars;
 
 /* Representation of graph */
@@ -70,13 +173,30 @@ typedef struct {
 
 
     /* Graph structure representation */
-    // Adjacency lists.  Includes self edge. Length=M+N.  Combined into single vector
+    // Adjacency lists.  Includes self edge. Length=M+N.  Combined into single vector.  NULL once narrowed
     int *neighbor;
     // Starting index for each adjacency list.  Length=N+1
     int *neighbor_start;
     double * gsums;         //accumulative sum of weights for self and neighbors
+    // Same lists with 16-bit node Ids, replacing neighbor once narrowed (see narrow_graph).  Otherwise NULL
+    uint16_t *neighbor16;
+
+    /* Memory-mapped binary file holding neighbor & neighbor_start.  NULL if none */
+    void *map;
+    size_t map_len;
+    /* Structure borrowed from another graph or from shared memory.  Only gsums & renumbering are owned */
+    bool shared;
+
+    /* Node renumbering.  Both NULL when nodes have their file numbering */
+    int *node_order;  // Original Id of each node.  Length = N
+    int *node_rank;   // New Id for each original Id.  Length = N
 } graph_t;
 
+/* Node at edge eid, in whichever width the adjacency lists are held */
+static inline int graph_neighbor(graph_t *g, int eid) {
+    return g->neighbor16 != NULL ? g->neighbor16[eid] : g->neighbor[eid];
+}
+
 /* Representation of simulation state */
 typedef struct {
     graph_t *g; //graph
@@ -85,21 +205,43 @@ typedef struct {
     /* MPI processes & process id */
     int nprocess;
     int process_id;
+    /* Number of threads */
+    int nthread;
 
     /* Random seed controlling simulation */
     random_t global_seed;
 
     /* State representation */
-    // Node Id for each rat.  Length=R
+    // Node Id for each rat.  Length=R.  Points into map for binary rat files
     int *rat_position;
     // Next node Id for each rat.  Length=R
     int *next_rat_position;
     // Rat seeds.  Length = R
     random_t *rat_seed;
+    // Random value in [0.0, 1.0) drawn for each rat in current batch.  Length = R
+    double *rat_draw;
+    /* Memory-mapped binary rat file.  NULL if none */
+    void *map;
+    size_t map_len;
 
     /* Redundant encodings to speed computation */
     // Count of number of rats at each node.  Length = N.
     int *rat_count;
+    // Private counts for each thread.  Length = T*N.  NULL when T = 1
+    int *thread_count;
+    // Scheduler for threaded loops.  NULL when T = 1
+    struct sched *sched;
+    // Nodes whose counts changed since gsums was last updated.  Length = N
+    int ndirty;
+    int *dirty_node;
+    bool *node_dirty;
+    // Nodes whose gsums must be accumulated again.  Length = N
+    int *stale_node;
+    bool *node_stale;
+    // First edge of each stale node whose weight changed.  Length = N
+    int *stale_from;
+    // Position of each edge in the neighbor's adjacency list.  Length = M+N.  NULL until simulating
+    int *reverse_edge;
     /* Computed parameters */
     double load_factor;  // nrat/nnnode
     update_t update_mode; 
@@ -107,15 +249,170 @@ typedef struct {
 
     double *pre_computed;
 
+    /* Number of steps simulated so far */
+    int step;
+    /* Write checkpoint to file every checkpoint_interval steps (0 = only at end).  No checkpoints when name is NULL */
+    char *checkpoint_name;
+    int checkpoint_interval;
+    struct checkpointer *checkpointer;
+
+    /* Phase timings.  Length = T.  NULL unless PROFILE is enabled */
+    profile_t *profile;
+
+    /* Output stage.  NULL when printing directly */
+    output_t output_format;
+    struct writer *writer;
+    /* Frames the simulation can get ahead of the output stage before it waits */
+    int output_depth;
+
+    /* Division of work among MPI processes */
+    partition_t partition;
+    /* Steps between rebalancing node blocks.  0 = never */
+    int rebalance_interval;
+#if MPI
+    /* Node-domain decomposition.  NULL when nodes are not partitioned */
+    struct domain *domain;
+    /* Rat partitioning.  NULL when rats are not partitioned */
+    struct ratpart *ratpart;
+#endif
+
 } state_t;
+
+#if MPI
+/*
+  Node-domain decomposition used by crun-mpi.  The nodes are split
+  into contiguous blocks of rows, with block boundaries on multiples
+  of tile_max, so that only grid edges cross between blocks.  Each
+  process moves the rats located in its block, hands off rats that
+  leave the block to the neighboring process, and exchanges the counts
+  for the boundary rows after every batch.
+*/
+typedef struct domain {
+    /* Number of processes owning nonempty blocks */
+    int nactive;
+    /* First node of each block.  Length = nactive+1 */
+    int *node_start;
+    /* Number of tiles of tile_max rows.  Blocks consist of whole tiles */
+    int ntile;
+    /* Work for each tile, for this process and for all.  Length = ntile */
+    double *tile_work;
+    double *total_work;
+    /* Block boundaries being considered when rebalancing.  Length = nactive+1 */
+    int *new_start;
+    /* Nodes owned by this process: [node_lo, node_hi) */
+    int node_lo;
+    int node_hi;
+    /* Owned nodes plus all of their neighbors: [halo_lo, halo_hi) */
+    int halo_lo;
+    int halo_hi;
+    /* Processes owning neighboring blocks (MPI_PROC_NULL if none) */
+    int lo_rank;
+    int hi_rank;
+    /* Number of owned nodes in lower & upper neighbors' halos */
+    int halo_send_lo;
+    int halo_send_hi;
+    /*
+      Owned nodes with no neighbor in the halo or the neighbors' halos:
+      [inner_lo, inner_hi).  Their gsums don't depend on exchanged rats
+      or counts.  Empty range at node_hi if there are none
+     */
+    int inner_lo;
+    int inner_hi;
+    /* Counts & displacements for gathering rat counts.  Length = P */
+    int *gather_count;
+    int *gather_disp;
+
+    /* Ids of rats located in this block, in increasing order */
+    int nlocal;
+    int *local_rat;
+    /* Index in local_rat of first rat in the current batch */
+    int cursor;
+    /* Local rats for the next step, built up batch by batch */
+    int nnext;
+    int *next_local_rat;
+    /* Rats in current batch that remained in this block */
+    int nstay;
+    int *stay_rat;
+
+    /* Rats handed off to & from neighbors as (rid, nid, seed) triples */
+    int buf_len;   // Capacity of each buffer, in triples
+    int nsend_lo;
+    int nsend_hi;
+    int *send_lo;
+    int *send_hi;
+    int *recv_lo;
+    int *recv_hi;
+    /* Pending receives & sends of rats */
+    MPI_Request rat_req[4];
+} domain_t;
+
+/*
+  Rat partitioning used by crun-mpi.  Every process keeps the counts
+  and gsums for the whole graph, but moves only its own slice of each
+  batch.  After every batch, the processes combine their changes to
+  the node counts with a single collective operation.
+*/
+typedef struct ratpart {
+    /* Count changes from this process's slice.  Length = N */
+    int *delta;
+    /* Count changes summed over all processes.  Length = N */
+    int *total_delta;
+    /*
+      Changes packed as number of pairs, followed by (nid, delta) pairs.
+      Capacity pack_len ints for each process.  NULL when never smaller than N
+     */
+    int pack_len;
+    int *pack;
+    int *all_pack;
+    /* Rats moved by this process, in increasing order */
+    int nown;
+    int *own_rat;
+} ratpart_t;
+#endif
     
 
 /*** Functions in graph.c. ***/
 graph_t *new_graph(int nnode, int nedge, int tile_max);
 
 void free_graph(graph_t *g);
+/*
+  Copy of graph sharing its structure, with its own gsums & renumbering, so that
+  several simulations can run on it at once.  Free the copy before the
+  original.  Returns NULL on failure
+ */
+graph_t *share_graph(graph_t *g);
 
+/* Read text or binary graph file, detecting format automatically */
 graph_t *read_graph(FILE *gfile);
+#if MPI
+/*
+  Give every process the master's graph, with the adjacency structure
+  held once per machine in an MPI-3 shared memory window.  The master
+  passes its graph, and the others pass NULL to get one of the given
+  size.  Collective
+ */
+graph_t *distribute_graph(graph_t *g, int nnode, int nedge, int tile_max);
+/* Free shared memory window, before MPI_Finalize.  Collective */
+void free_graph_window();
+#endif
+
+/* Write graph in binary format */
+bool write_graph(graph_t *g, FILE *outfile);
+
+/*
+  Renumber nodes to improve locality.  Adjacency lists keep their
+  original order, so that simulation results are unchanged
+ */
+bool reorder_graph(graph_t *g, order_t order);
+/*
+  Switch adjacency lists to 16-bit node Ids when they fit, releasing
+  the 32-bit lists.  Read the lists with graph_neighbor() afterward.
+  Returns false if the lists keep 32 bits
+ */
+bool narrow_graph(graph_t *g);
+
+/* Hash of graph structure, using the numbering from the graph file */
+uint64_t graph_fingerprint(graph_t *g);
 
 #if DEBUG
 void show_graph(graph_t *g);
@@ -130,11 +427,27 @@ void outmsg(char *fmt, ...);
 /* Allocate and zero arrays of int/double */
 int *int_alloc(size_t n);
 double *double_alloc(size_t n);
+/* Allocate and zero large arrays on huge pages.  Free with page_free */
+void *page_alloc(size_t n, size_t size);
+void page_free(void *p, size_t n, size_t size);
+/* Spread large arrays across NUMA nodes, rather than placing pages on first touch */
+void set_interleave(bool on);
+/* Report memory held by large arrays */
+void report_memory();
 
 
-/* Read rat file and initialize simulation state */
+/* Read text or binary rat file and initialize simulation state */
 state_t *read_rats(graph_t *g, FILE *infile, random_t global_seed);
+/* Write rat positions in binary format */
+bool write_rats(state_t *s, FILE *outfile);
+bool write_positions(int nnode, int nrat, int *rat_position, FILE *outfile);
+/* Convert rat positions to match renumbered graph */
+void reorder_rats(state_t *s);
 state_t *new_rats(graph_t *g, int nrat, random_t global_seed);
+/* Free simulation state, but not its graph */
+void free_rats(state_t *s);
+/* Seed the rats and tabulate weights once the rat positions are known */
+void init_rats(state_t *s);
 
 /* Generate done message from simulator */
 void done();
@@ -148,6 +461,145 @@ void show(state_t *s, bool show_counts);
 /* Run simulation */
 void simulate(state_t *s, int count, update_t update_mode, int dinterval, bool display);
 void take_census(state_t *s);
+/*
+  Find where each edge appears in the adjacency list of its neighbor.
+  Returns NULL on failure, or when some edge has no reverse
+ */
+int *find_reverse_edges(graph_t *g);
+/* Recompute gsums for nodes [nlo, nhi), based on counts for nodes [wlo, whi) */
+void compute_gsums(state_t *s, int wlo, int whi, int nlo, int nhi);
+/* Same, but only for nodes next to ones whose counts have changed */
+void update_gsums(state_t *s, int wlo, int whi, int nlo, int nhi);
+
+/* Record that count for node has changed */
+static inline void mark_dirty(state_t *s, int nid) {
+    if (!s->node_dirty[nid]) {
+        s->node_dirty[nid] = true;
+        s->dirty_node[s->ndirty++] = nid;
+    }
+}
+
+/*** Functions in output.c ***/
+/*
+  Start output stage, writing on separate thread.  Binary output has
+  frames of 32-bit ints: "STEP" N R flag, followed by N counts when
+  flag is nonzero.  Output ends with "DONE".  Returns NULL on failure,
+  in which case show() prints text directly
+ */
+struct writer *new_writer(state_t *s, output_t format);
+/* Queue snapshot of current state for output */
+void write_step(state_t *s, bool show_counts);
+/* Generate done message, then wait for output stage to finish */
+void finish_writer(state_t *s);
+/*
+  Print line "HASH step counts [positions]" with hashes of the rat
+  counts and, for OUTPUT_HASH_RATS, the rat positions.  Each hash is
+  the sum over nodes (or rats) of a mix of the index and value, with
+  nodes numbered as in the graph file.  Collective operation when the
+  simulation is partitioned among processes
+ */
+void show_hash(state_t *s);
+/* Same hashes of counts & positions, for a simulation held by one process */
+void state_hash(state_t *s, uint64_t h[2]);
+
+/*** Functions in ensemble.c ***/
+/*
+  Run nrun independent simulations from the positions in s, with
+  seeds global_seed, global_seed+1, ...  The simulations share the
+  graph structure and run concurrently on s->nthread threads.  Prints
+  each run's final hash and summary statistics when display is set
+ */
+void run_ensemble(state_t *s, int nrun, int count, update_t update_mode, bool display);
+
+/*** Functions in sched.c ***/
+/* Allocate scheduler for nthread threads.  Returns NULL on failure */
+sched_t *new_sched(int nthread);
+void free_sched(sched_t *sc);
+/*
+  Split indices [lo, hi) into chunks of about equal weight, where
+  index i has weight weight_start[i+1] - weight_start[i].  With
+  weight_start NULL, all indices have equal weight.  Must be called
+  outside of parallel regions
+ */
+void sched_split(sched_t *sc, int lo, int hi, int *weight_start);
+/* Get next range [*lo, *hi) for thread tid to process.  Returns false once no work remains */
+bool sched_next(sched_t *sc, int tid, int *lo, int *hi);
+
+/*** Functions in checkpoint.c ***/
+/* Set up checkpointing to named file.  Returns NULL on failure */
+struct checkpointer *new_checkpointer(state_t *s, char *fname);
+/*
+  Start writing checkpoint of the current state on separate thread.
+  Waits for the previous checkpoint to finish first.  Called only by the master
+ */
+void write_checkpoint(state_t *s);
+/* Wait for last checkpoint to be written, and free storage */
+void free_checkpointer(struct checkpointer *c);
+/*
+  Read checkpoint for graph and initialize simulation state from it.
+  Rat positions use the numbering from the graph file.  Returns NULL on failure
+ */
+state_t *read_checkpoint(graph_t *g, FILE *infile, random_t global_seed);
+
+/*** Functions in profile.c ***/
+#if PROFILE
+/* Allocate zeroed timings for each thread.  Returns NULL on failure */
+profile_t *new_profile(int nthread);
+/* Collect timings from all processes and write JSON report at the master */
+void write_profile(state_t *s, char *fname);
+
+/* Charge cycles since start to phase for the calling thread.  Ignored before simulation starts */
+static inline void profile_add(state_t *s, phase_t phase, uint64_t start) {
+    if (s->profile == NULL)
+        return;
+#if OMP
+    profile_t *p = &s->profile[omp_get_thread_num()];
+#else
+    profile_t *p = &s->profile[0];
+#endif
+    p->ticks[phase] += currentTicks() - start;
+    p->calls[phase]++;
+}
+
+#define PROFILE_START(t) uint64_t t = currentTicks()
+#define PROFILE_STOP(s, phase, t) profile_add(s, phase, t)
+#else
+#define PROFILE_START(t)
+#define PROFILE_STOP(s, phase, t)
+#endif
+
+#if MPI
+/*** Functions in domain.c ***/
+/* Partition nodes & rats among processes.  Aborts all processes on failure */
+domain_t *new_domain(state_t *s, int batch_size);
+void free_domain(domain_t *d);
+/* Start swapping handed-off rats with neighbors */
+void start_exchange_rats(state_t *s);
+/* Wait for the swap to finish, and add the arriving rats to local rats */
+void finish_exchange_rats(state_t *s);
+/* Swap counts for boundary rows with neighbors */
+void exchange_halo(state_t *s);
+/* Switch to ownership list for next step */
+void finish_domain_step(state_t *s);
+/* Collect all rat counts at the master */
+void gather_counts(state_t *s);
+/* Move block boundaries to even out work among processes.  Returns true if they changed */
+bool rebalance_domain(state_t *s);
+/* Collect positions & seeds of all rats at the master, given the nlocal rats held by each process */
+void gather_rats(state_t *s, int nlocal, int *local_rat);
+
+/*** Functions in ratpart.c ***/
+/* Assign slices of each batch to processes.  Aborts all processes on failure */
+ratpart_t *new_ratpart(state_t *s, int batch_size);
+void free_ratpart(ratpart_t *rp);
+/* Find slice [lo, hi) of batch moved by this process */
+void slice_range(state_t *s, int bstart, int bcount, int *lo, int *hi);
+/*
+  Combine the count changes from every process's slice of the batch,
+  and mark the changed nodes as dirty
+ */
+void exchange_deltas(state_t *s, int bstart, int bcount);
+#endif
 
 #define CRUN_H
 #endif /* CRUN_H */
@@ -1,6 +1,11 @@
 #ifndef CYCLETIMER_H
 /* Cycle timer code, adapted from CycleTimer.h found in 15-418 code repositories */
 
+#include <stdint.h>
+
 double currentSeconds();
+/* Raw cycle counter, and its conversion factor to seconds */
+uint64_t currentTicks();
+double secondsPerTick();
 #define CYCLETIMER_H
 #endif
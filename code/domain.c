@@ -0,0 +1,486 @@
+/* Node-domain decomposition of the simulation for crun-mpi */
+
+#include "crun.h"
+
+/* Message tags */
+#define TAG_RATS 1
+#define TAG_HALO 2
+
+/* Split rows into nactive blocks of whole tiles */
+static void partition_rows(graph_t *g, int nactive, int ntile, int *node_start) {
+    int p;
+    for (p = 0; p < nactive; p++) {
+        int row = (int) (((long) p * ntile) / nactive) * g->tile_max;
+        if (row > g->nrow)
+            row = g->nrow;
+        node_start[p] = row * g->nrow;
+    }
+    node_start[nactive] = g->nnode;
+}
+
+/* Find range of nodes adjacent to nodes [nlo, nhi) */
+static void find_halo(graph_t *g, int nlo, int nhi, int *hlo, int *hhi) {
+    int nid, eid;
+    int lo = nlo;
+    int hi = nhi;
+    for (nid = nlo; nid < nhi; nid++) {
+        for (eid = g->neighbor_start[nid]; eid < g->neighbor_start[nid+1]; eid++) {
+            int nnid = graph_neighbor(g, eid);
+            if (nnid < lo)
+                lo = nnid;
+            if (nnid >= hi)
+                hi = nnid + 1;
+        }
+    }
+    *hlo = lo;
+    *hhi = hi;
+}
+
+/*
+  Check that every block only connects to the blocks directly before
+  and after it.  This holds when the blocks are aligned with tile_max.
+ */
+static bool halo_ok(graph_t *g, int nactive, int *node_start) {
+    int p;
+    for (p = 0; p < nactive; p++) {
+        int hlo, hhi;
+        find_halo(g, node_start[p], node_start[p+1], &hlo, &hhi);
+        if (p > 0 && hlo < node_start[p-1])
+            return false;
+        if (p < nactive-1 && hhi > node_start[p+2])
+            return false;
+    }
+    return true;
+}
+
+/*
+  Find owned nodes whose neighbors all lie outside of the halo, and
+  outside of the boundary rows that rats from the neighbors can reach
+ */
+static void find_interior(graph_t *g, domain_t *d) {
+    /* Counts can change in exchanges below clo and at or above chi */
+    int clo = d->node_lo + d->halo_send_lo;
+    int chi = d->node_hi - d->halo_send_hi;
+    int lo = d->node_lo;
+    int hi = d->node_hi;
+    int nid, eid;
+    for (nid = d->node_lo; nid < d->node_hi; nid++) {
+        for (eid = g->neighbor_start[nid]; eid < g->neighbor_start[nid+1]; eid++) {
+            int nnid = graph_neighbor(g, eid);
+            if (nnid < clo && nid >= lo)
+                lo = nid + 1;
+            if (nnid >= chi && nid < hi)
+                hi = nid;
+        }
+    }
+    if (lo >= hi)
+        lo = hi = d->node_hi;
+    d->inner_lo = lo;
+    d->inner_hi = hi;
+}
+
+/* Find range of nodes, neighbors, and local rats for this process, given block boundaries */
+static void init_blocks(state_t *s, domain_t *d) {
+    graph_t *g = s->g;
+    int nprocess = s->nprocess;
+    int process_id = s->process_id;
+    int p, ri;
+
+    for (p = 0; p < nprocess; p++) {
+        if (p < d->nactive) {
+            d->gather_disp[p] = d->node_start[p];
+            d->gather_count[p] = d->node_start[p+1] - d->node_start[p];
+        } else {
+            d->gather_disp[p] = 0;
+            d->gather_count[p] = 0;
+        }
+    }
+
+    if (process_id < d->nactive) {
+        d->node_lo = d->node_start[process_id];
+        d->node_hi = d->node_start[process_id+1];
+        find_halo(g, d->node_lo, d->node_hi, &d->halo_lo, &d->halo_hi);
+        d->lo_rank = process_id > 0 ? process_id-1 : MPI_PROC_NULL;
+        d->hi_rank = process_id < d->nactive-1 ? process_id+1 : MPI_PROC_NULL;
+    } else {
+        d->node_lo = d->node_hi = g->nnode;
+        d->halo_lo = d->halo_hi = g->nnode;
+        d->lo_rank = d->hi_rank = MPI_PROC_NULL;
+    }
+
+    /* Find how many of our boundary nodes lie in the neighbors' halos */
+    int hlo, hhi;
+    d->halo_send_lo = 0;
+    d->halo_send_hi = 0;
+    if (d->lo_rank != MPI_PROC_NULL) {
+        find_halo(g, d->node_start[process_id-1], d->node_lo, &hlo, &hhi);
+        d->halo_send_lo = hhi - d->node_lo;
+    }
+    if (d->hi_rank != MPI_PROC_NULL) {
+        find_halo(g, d->node_hi, d->node_start[process_id+2], &hlo, &hhi);
+        d->halo_send_hi = d->node_hi - hlo;
+    }
+
+    find_interior(g, d);
+
+    d->nlocal = 0;
+    for (ri = 0; ri < s->nrat; ri++) {
+        int nid = s->rat_position[ri];
+        if (nid >= d->node_lo && nid < d->node_hi)
+            d->local_rat[d->nlocal++] = ri;
+    }
+    d->cursor = 0;
+    d->nnext = 0;
+    d->nstay = 0;
+    d->nsend_lo = 0;
+    d->nsend_hi = 0;
+}
+
+/* Partition nodes & rats among processes.  Returns NULL on failure */
+domain_t *new_domain(state_t *s, int batch_size) {
+    graph_t *g = s->g;
+    int nprocess = s->nprocess;
+    int process_id = s->process_id;
+
+    /* The other processes would wait forever in collective operations */
+    domain_t *d = calloc(1, sizeof(domain_t));
+    if (d == NULL) {
+        outmsg("Couldn't allocate storage for domain\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    /* Only partition square grids.  Anything else stays in one block */
+    d->ntile = 1;
+    if (g->nrow * g->nrow == g->nnode)
+        d->ntile = (g->nrow + g->tile_max - 1) / g->tile_max;
+    d->nactive = nprocess < d->ntile ? nprocess : d->ntile;
+    d->node_start = int_alloc(nprocess + 1);
+    d->new_start = int_alloc(nprocess + 1);
+    d->gather_count = int_alloc(nprocess);
+    d->gather_disp = int_alloc(nprocess);
+    d->tile_work = double_alloc(d->ntile);
+    d->total_work = double_alloc(d->ntile);
+    if (d->node_start == NULL || d->new_start == NULL || d->gather_count == NULL ||
+        d->gather_disp == NULL || d->tile_work == NULL || d->total_work == NULL) {
+        outmsg("Couldn't allocate storage for domain\n");
+        free_domain(d);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    partition_rows(g, d->nactive, d->ntile, d->node_start);
+    if (!halo_ok(g, d->nactive, d->node_start)) {
+        if (process_id == 0)
+            outmsg("WARNING: Graph has non-grid edges between tiles.  Using single block\n");
+        d->nactive = 1;
+        d->ntile = 1;
+        partition_rows(g, d->nactive, 1, d->node_start);
+    }
+
+    /* Every rat in a batch could end up in the same buffer */
+    d->buf_len = batch_size;
+    d->local_rat = int_alloc(s->nrat);
+    d->next_local_rat = int_alloc(s->nrat);
+    d->stay_rat = int_alloc(batch_size);
+    d->send_lo = int_alloc(3 * d->buf_len);
+    d->send_hi = int_alloc(3 * d->buf_len);
+    d->recv_lo = int_alloc(3 * d->buf_len);
+    d->recv_hi = int_alloc(3 * d->buf_len);
+    if (d->local_rat == NULL || d->next_local_rat == NULL || d->stay_rat == NULL ||
+        d->send_lo == NULL || d->send_hi == NULL || d->recv_lo == NULL || d->recv_hi == NULL) {
+        outmsg("Couldn't allocate space for %d rats in domain\n", s->nrat);
+        free_domain(d);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    init_blocks(s, d);
+    return d;
+}
+
+void free_domain(domain_t *d) {
+    free(d->node_start);
+    free(d->new_start);
+    free(d->tile_work);
+    free(d->total_work);
+    free(d->gather_count);
+    free(d->gather_disp);
+    free(d->local_rat);
+    free(d->next_local_rat);
+    free(d->stay_rat);
+    free(d->send_lo);
+    free(d->send_hi);
+    free(d->recv_lo);
+    free(d->recv_hi);
+    free(d);
+}
+
+/* Install rats received from neighbor.  Returns number of rats */
+static int accept_rats(state_t *s, int *buf, MPI_Status *status) {
+    int len, i;
+    MPI_Get_count(status, MPI_INT, &len);
+    if (len == MPI_UNDEFINED)
+        return 0;
+    int n = len / 3;
+    for (i = 0; i < n; i++) {
+        int rid = buf[3*i];
+        int nid = buf[3*i+1];
+        s->rat_position[rid] = nid;
+        s->rat_seed[rid] = (random_t) buf[3*i+2];
+        s->rat_count[nid]++;
+        mark_dirty(s, nid);
+    }
+    return n;
+}
+
+/* Start swapping handed-off rats with neighbors */
+void start_exchange_rats(state_t *s) {
+    domain_t *d = s->domain;
+    MPI_Request *req = d->rat_req;
+
+    /* Exchanges in both directions proceed at once */
+    MPI_Irecv(d->recv_lo, 3 * d->buf_len, MPI_INT, d->lo_rank, TAG_RATS, MPI_COMM_WORLD, &req[0]);
+    MPI_Irecv(d->recv_hi, 3 * d->buf_len, MPI_INT, d->hi_rank, TAG_RATS, MPI_COMM_WORLD, &req[1]);
+    MPI_Isend(d->send_hi, 3 * d->nsend_hi, MPI_INT, d->hi_rank, TAG_RATS, MPI_COMM_WORLD, &req[2]);
+    MPI_Isend(d->send_lo, 3 * d->nsend_lo, MPI_INT, d->lo_rank, TAG_RATS, MPI_COMM_WORLD, &req[3]);
+}
+
+/* Wait for the swap to finish, and add the arriving rats to local rats */
+void finish_exchange_rats(state_t *s) {
+    domain_t *d = s->domain;
+    MPI_Status status[4];
+    int nlo, nhi;
+
+    MPI_Waitall(4, d->rat_req, status);
+    nlo = accept_rats(s, d->recv_lo, &status[0]);
+    nhi = accept_rats(s, d->recv_hi, &status[1]);
+
+    /* Merge staying and arriving rats, keeping them in order of rat Id */
+    int i = 0, j = 0, k = 0;
+    int *next = d->next_local_rat;
+    int n = d->nnext;
+    while (i < d->nstay || j < nlo || k < nhi) {
+        int ri = i < d->nstay ? d->stay_rat[i] : s->nrat;
+        int rj = j < nlo ? d->recv_lo[3*j] : s->nrat;
+        int rk = k < nhi ? d->recv_hi[3*k] : s->nrat;
+        if (ri < rj && ri < rk) {
+            next[n++] = ri;
+            i++;
+        } else if (rj < rk) {
+            next[n++] = rj;
+            j++;
+        } else {
+            next[n++] = rk;
+            k++;
+        }
+    }
+    d->nnext = n;
+}
+
+/* Swap counts for boundary rows with neighbors */
+void exchange_halo(state_t *s) {
+    domain_t *d = s->domain;
+    int *rat_count = s->rat_count;
+    MPI_Request req[4];
+    int nid;
+
+    MPI_Irecv(rat_count + d->halo_lo, d->node_lo - d->halo_lo, MPI_INT, d->lo_rank, TAG_HALO,
+              MPI_COMM_WORLD, &req[0]);
+    MPI_Irecv(rat_count + d->node_hi, d->halo_hi - d->node_hi, MPI_INT, d->hi_rank, TAG_HALO,
+              MPI_COMM_WORLD, &req[1]);
+    MPI_Isend(rat_count + d->node_hi - d->halo_send_hi, d->halo_send_hi, MPI_INT, d->hi_rank, TAG_HALO,
+              MPI_COMM_WORLD, &req[2]);
+    MPI_Isend(rat_count + d->node_lo, d->halo_send_lo, MPI_INT, d->lo_rank, TAG_HALO,
+              MPI_COMM_WORLD, &req[3]);
+    MPI_Waitall(4, req, MPI_STATUSES_IGNORE);
+
+    /* Boundary rows are short, so treat them as changed */
+    for (nid = d->halo_lo; nid < d->node_lo; nid++)
+        mark_dirty(s, nid);
+    for (nid = d->node_hi; nid < d->halo_hi; nid++)
+        mark_dirty(s, nid);
+}
+
+/* Switch to ownership list for next step */
+void finish_domain_step(state_t *s) {
+    domain_t *d = s->domain;
+    int *t = d->local_rat;
+    d->local_rat = d->next_local_rat;
+    d->next_local_rat = t;
+    d->nlocal = d->nnext;
+    d->nnext = 0;
+    d->cursor = 0;
+}
+
+/* Collect all rat counts at the master */
+void gather_counts(state_t *s) {
+    domain_t *d = s->domain;
+    int *rat_count = s->rat_count;
+    int count = d->node_hi - d->node_lo;
+    if (s->process_id == 0)
+        MPI_Gatherv(MPI_IN_PLACE, count, MPI_INT,
+                    rat_count, d->gather_count, d->gather_disp, MPI_INT,
+                    0, MPI_COMM_WORLD);
+    else
+        MPI_Gatherv(rat_count + d->node_lo, count, MPI_INT,
+                    rat_count, d->gather_count, d->gather_disp, MPI_INT,
+                    0, MPI_COMM_WORLD);
+}
+
+/* Collect positions & seeds of rats held by each process, at the master or at all processes */
+static void collect_rats(state_t *s, int nlocal, int *local_rat, bool everywhere) {
+    bool receive = everywhere || s->process_id == 0;
+    int n = 3 * nlocal;
+    int *rcount = NULL;
+    int *rdisp = NULL;
+    int *rbuf = NULL;
+    int total = 0;
+    int i, p;
+
+    int *sbuf = int_alloc(n + 1);
+    if (receive) {
+        rcount = int_alloc(s->nprocess);
+        rdisp = int_alloc(s->nprocess);
+        rbuf = int_alloc(3 * (size_t) s->nrat);
+    }
+    if (sbuf == NULL || (receive && (rcount == NULL || rdisp == NULL || rbuf == NULL))) {
+        outmsg("Couldn't allocate space for gathering %d rats\n", s->nrat);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    for (i = 0; i < nlocal; i++) {
+        int rid = local_rat[i];
+        sbuf[3*i] = rid;
+        sbuf[3*i+1] = s->rat_position[rid];
+        sbuf[3*i+2] = (int) s->rat_seed[rid];
+    }
+
+    if (everywhere)
+        MPI_Allgather(&n, 1, MPI_INT, rcount, 1, MPI_INT, MPI_COMM_WORLD);
+    else
+        MPI_Gather(&n, 1, MPI_INT, rcount, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if (receive) {
+        for (p = 0; p < s->nprocess; p++) {
+            rdisp[p] = total;
+            total += rcount[p];
+        }
+    }
+    if (everywhere)
+        MPI_Allgatherv(sbuf, n, MPI_INT, rbuf, rcount, rdisp, MPI_INT, MPI_COMM_WORLD);
+    else
+        MPI_Gatherv(sbuf, n, MPI_INT, rbuf, rcount, rdisp, MPI_INT, 0, MPI_COMM_WORLD);
+
+    if (receive) {
+        for (i = 0; i < total / 3; i++) {
+            int rid = rbuf[3*i];
+            s->rat_position[rid] = rbuf[3*i+1];
+            s->rat_seed[rid] = (random_t) rbuf[3*i+2];
+        }
+    }
+    free(sbuf);
+    free(rcount);
+    free(rdisp);
+    free(rbuf);
+}
+
+/* Collect positions & seeds of all rats at the master, given the nlocal rats held by each process */
+void gather_rats(state_t *s, int nlocal, int *local_rat) {
+    collect_rats(s, nlocal, local_rat, false);
+}
+
+/* Estimated work for node: accumulating its gsums, plus the search done by each rat there */
+static inline double node_work(graph_t *g, int count, int nid) {
+    int degree = g->neighbor_start[nid+1] - g->neighbor_start[nid];
+    return (double) (count + 1) * degree;
+}
+
+/* Find largest work among blocks */
+static double max_block_work(graph_t *g, int nactive, int *node_start, double *work) {
+    int rows_per_tile = g->tile_max * g->nrow;
+    double max = 0.0;
+    int p, t;
+    for (p = 0; p < nactive; p++) {
+        double sum = 0.0;
+        for (t = node_start[p] / rows_per_tile; t * rows_per_tile < node_start[p+1]; t++)
+            sum += work[t];
+        if (sum > max)
+            max = sum;
+    }
+    return max;
+}
+
+/*
+  Split tiles into nactive blocks, placing each boundary at the tile
+  boundary where the cumulative work is closest to an even share.
+  Every block gets at least one tile.
+ */
+static void balance_rows(graph_t *g, int nactive, int ntile, double *work, int *node_start) {
+    double total = 0.0;
+    int p, t;
+    for (t = 0; t < ntile; t++)
+        total += work[t];
+
+    double prefix = 0.0;
+    int tile = 0;
+    node_start[0] = 0;
+    for (p = 1; p < nactive; p++) {
+        double target = total * p / nactive;
+        int lo = tile + 1;
+        int hi = ntile - (nactive - p);
+        /* Advance while the next boundary is at least as close to the target */
+        while (tile < hi && (tile < lo || prefix + work[tile] / 2 < target)) {
+            prefix += work[tile];
+            tile++;
+        }
+        int row = tile * g->tile_max;
+        node_start[p] = (row > g->nrow ? g->nrow : row) * g->nrow;
+    }
+    node_start[nactive] = g->nnode;
+}
+
+/*
+  Move block boundaries so that each process has about the same amount
+  of work, based on the current rat counts.  Does nothing unless the
+  most heavily loaded block has over REBALANCE_THRESHOLD times its share.
+  Migrating shares all rats with every process, which then takes the
+  ones in its new block.  Returns true if the boundaries changed
+ */
+bool rebalance_domain(state_t *s) {
+    domain_t *d = s->domain;
+    graph_t *g = s->g;
+    int rows_per_tile = g->tile_max * g->nrow;
+    int nid, t, p;
+
+    if (d->nactive < 2)
+        return false;
+
+    memset(d->tile_work, 0, d->ntile * sizeof(double));
+    for (nid = d->node_lo; nid < d->node_hi; nid++)
+        d->tile_work[nid / rows_per_tile] += node_work(g, s->rat_count[nid], nid);
+    MPI_Allreduce(d->tile_work, d->total_work, d->ntile, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+
+    double total = 0.0;
+    for (t = 0; t < d->ntile; t++)
+        total += d->total_work[t];
+    double old_max = max_block_work(g, d->nactive, d->node_start, d->total_work);
+    if (old_max <= REBALANCE_THRESHOLD * total / d->nactive)
+        return false;
+
+    balance_rows(g, d->nactive, d->ntile, d->total_work, d->new_start);
+    if (max_block_work(g, d->nactive, d->new_start, d->total_work) >= old_max)
+        return false;
+    if (!halo_ok(g, d->nactive, d->new_start))
+        return false;
+
+    collect_rats(s, d->nlocal, d->local_rat, true);
+    int *tmp = d->node_start;
+    d->node_start = d->new_start;
+    d->new_start = tmp;
+    /* Counts outside the old halo are out of date */
+    take_census(s);
+    init_blocks(s, d);
+    if (s->process_id == 0) {
+        char buf[MAXLINE];
+        int len = 0;
+        for (p = 0; p < d->nactive && len < MAXLINE - 16; p++)
+            len += sprintf(buf + len, " %d", d->node_start[p] / g->nrow);
+        outmsg("Rebalanced blocks after step %d.  Starting rows:%s\n", s->step, buf);
+    }
+    return true;
+}
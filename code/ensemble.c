@@ -0,0 +1,155 @@
+/*
+  Ensemble of simulations that differ only in their seeds.  The graph
+  is loaded once, and each run gets a copy sharing its structure (and
+  its reverse edges), so that only gsums is duplicated.  Runs are
+  spread across threads, each run simulating on a single thread.
+*/
+
+#include "crun.h"
+
+/* Final results of one run */
+typedef struct {
+    uint64_t hash[2];
+    int max_count;
+    int nempty;
+} result_t;
+
+/* Set up run with same graph structure & starting positions as s.  Returns NULL on failure */
+static state_t *new_run(state_t *s, random_t seed) {
+    graph_t *g = share_graph(s->g);
+    if (g == NULL) {
+	outmsg("Couldn't allocate graph for ensemble run\n");
+	return NULL;
+    }
+    state_t *r = new_rats(g, s->nrat, seed);
+    if (r == NULL) {
+	free_graph(g);
+	return NULL;
+    }
+    memcpy(r->rat_position, s->rat_position, s->nrat * sizeof(int));
+    r->batch_size = s->batch_size;
+    r->output_format = s->output_format;
+    r->reverse_edge = s->reverse_edge;
+    return r;
+}
+
+static void free_run(state_t *r) {
+    graph_t *g = r->g;
+    /* Reverse edges belong to the first run */
+    r->reverse_edge = NULL;
+    free_rats(r);
+    free_graph(g);
+}
+
+static void summarize(state_t *s, result_t *res) {
+    int nid;
+    state_hash(s, res->hash);
+    res->max_count = 0;
+    res->nempty = 0;
+    for (nid = 0; nid < s->g->nnode; nid++) {
+	int c = s->rat_count[nid];
+	if (c > res->max_count)
+	    res->max_count = c;
+	if (c == 0)
+	    res->nempty++;
+    }
+}
+
+/* Print mean & standard deviation of n values */
+static void show_stat(char *name, double *val, int n) {
+    double sum = 0.0, sumsq = 0.0;
+    int i;
+    for (i = 0; i < n; i++) {
+	sum += val[i];
+	sumsq += val[i] * val[i];
+    }
+    double mean = sum / n;
+    double var = sumsq / n - mean * mean;
+    printf("STAT %s mean %.3f sd %.3f\n", name, mean, var > 0 ? sqrt(var) : 0.0);
+}
+
+void run_ensemble(state_t *s, int nrun, int count, update_t update_mode, bool display) {
+    state_t **run = calloc(nrun, sizeof(state_t *));
+    result_t *result = calloc(nrun, sizeof(result_t));
+    double *val = calloc(nrun, sizeof(double));
+    int nthread = s->nthread;
+    bool ok = run != NULL && result != NULL && val != NULL;
+    int i;
+
+    /* Runs share 16-bit adjacency lists & reverse edges set up here */
+    narrow_graph(s->g);
+    if (ok && s->reverse_edge == NULL) {
+	s->reverse_edge = find_reverse_edges(s->g);
+	if (s->reverse_edge == NULL)
+	    outmsg("Couldn't find reverse edges.  Accumulating whole adjacency lists\n");
+    }
+    /*
+      Allocate serially, since the memory totals aren't thread safe,
+      and copy the positions before the first run starts moving rats
+     */
+    if (ok) {
+	s->nthread = 1;
+	run[0] = s;
+	for (i = 1; ok && i < nrun; i++) {
+	    run[i] = new_run(s, s->global_seed + i);
+	    ok = run[i] != NULL;
+	}
+    }
+    if (!ok) {
+	outmsg("Couldn't allocate ensemble of %d runs\n", nrun);
+	for (i = 1; run != NULL && i < nrun && run[i] != NULL; i++)
+	    free_run(run[i]);
+	free(run);
+	free(result);
+	free(val);
+	s->nthread = nthread;
+	if (display)
+	    done();
+	return;
+    }
+
+#if PROFILE
+    /* Steps are charged to the thread running them, by its number in the ensemble */
+    for (i = 0; i < nrun; i++) {
+	if (run[i]->profile == NULL)
+	    run[i]->profile = new_profile(nthread);
+    }
+#endif
+#if OMP
+#pragma omp parallel for schedule(dynamic, 1) num_threads(nthread)
+#endif
+    for (i = 0; i < nrun; i++) {
+	state_t *r = run[i];
+	if (i > 0) {
+	    init_rats(r);
+	    take_census(r);
+	}
+	simulate(r, count, update_mode, count, false);
+	summarize(r, &result[i]);
+    }
+
+    if (display) {
+	for (i = 0; i < nrun; i++) {
+	    result_t *res = &result[i];
+	    printf("RUN %d SEED %u STEP %d HASH %016lx", i, run[i]->global_seed, run[i]->step,
+		   (unsigned long) res->hash[0]);
+	    if (s->output_format == OUTPUT_HASH_RATS)
+		printf(" %016lx", (unsigned long) res->hash[1]);
+	    printf(" MAX %d EMPTY %d\n", res->max_count, res->nempty);
+	}
+	for (i = 0; i < nrun; i++)
+	    val[i] = result[i].max_count;
+	show_stat("MAX", val, nrun);
+	for (i = 0; i < nrun; i++)
+	    val[i] = result[i].nempty;
+	show_stat("EMPTY", val, nrun);
+	done();
+    }
+
+    for (i = 1; i < nrun; i++)
+	free_run(run[i]);
+    s->nthread = nthread;
+    free(run);
+    free(result);
+    free(val);
+}
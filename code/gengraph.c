@@ -0,0 +1,562 @@
+/*
+  Generator for graphrat graphs and initial rat positions.  Produces
+  the same files as gengraph.py for the same parameters, but handles
+  much larger grids.  Can also write crun's binary formats directly.
+*/
+
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <limits.h>
+
+#include "crun.h"
+
+/* Rat modes, as in gengraph.py */
+typedef enum { RAT_UNIFORM, RAT_DIAGONAL, RAT_UPLEFT, RAT_LOWRIGHT } rat_mode_t;
+static char *mode_names[] = { "uniform", "diagonal", "upper-left", "lower-right" };
+
+/* Nodes per chunk when formatting text, and draws per block when permuting */
+#define GEN_CHUNK 4096
+#define DRAW_BLOCK (1 << 20)
+
+/* Hub node connected to every node of a rectangular region */
+typedef struct {
+    int cid;
+    int x, y, w, h;
+} hub_t;
+
+typedef struct {
+    int k;
+    int nnode;
+    int tile_max;
+    int nhub;
+    int hub_max;
+    hub_t *hub;
+} gen_t;
+
+static void usage(char *name) {
+    char *use_string = "-k K [-f] [-t T] [-o GFILE] [-r RFILE [-l LOAD] [-m (u|d|l|r)] [-s SEED]] [-b] [-T THD]";
+    outmsg("Usage: %s %s\n", name, use_string);
+    outmsg("   -h         Print this message\n");
+    outmsg("   -k K       Base graph as K x K grid\n");
+    outmsg("   -f         Create fractal graph\n");
+    outmsg("   -t T       Add tiles, each with TxT nodes\n");
+    outmsg("   -o GFILE   Graph file to write (default: standard output)\n");
+    outmsg("   -r RFILE   Also write rat position file\n");
+    outmsg("   -l LOAD    Rats per node\n");
+    outmsg("   -m MODE    Initial rat positions:\n");
+    outmsg("              u: Uniform.      Same number of rats at every node\n");
+    outmsg("              d: Diagonal.     All rats on the diagonal\n");
+    outmsg("              l: Upper left.   All rats at node 0\n");
+    outmsg("              r: Lower right.  All rats at last node\n");
+    outmsg("   -s SEED    Seed for permuting rats\n");
+    outmsg("   -b         Write binary files that crun can map directly\n");
+    outmsg("   -T THD     Number of threads\n");
+    exit(0);
+}
+
+static FILE *open_file(char *name, char *mode) {
+    FILE *f = fopen(name, mode);
+    if (f == NULL) {
+	outmsg("Couldn't open file %s\n", name);
+	exit(1);
+    }
+    return f;
+}
+
+static int id(gen_t *gen, int r, int c) {
+    if (r < 0 || r >= gen->k || c < 0 || c >= gen->k)
+	return -1;
+    return r * gen->k + c;
+}
+
+static void add_hub(gen_t *gen, int cid, int x, int y, int w, int h) {
+    if (cid < 0) {
+	outmsg("WARNING: Hub for region at (%d, %d) lies outside of grid\n", x, y);
+	return;
+    }
+    if (gen->nhub == gen->hub_max) {
+	gen->hub_max = gen->hub_max == 0 ? 64 : 2 * gen->hub_max;
+	gen->hub = realloc(gen->hub, gen->hub_max * sizeof(hub_t));
+	if (gen->hub == NULL) {
+	    outmsg("Couldn't allocate space for hubs\n");
+	    exit(1);
+	}
+    }
+    hub_t *hub = &gen->hub[gen->nhub++];
+    hub->cid = cid;
+    hub->x = x;
+    hub->y = y;
+    hub->w = w;
+    hub->h = h;
+}
+
+/* Place hubs within region, each connected to every node of the region */
+static void make_hubs(gen_t *gen, int x, int y, int w, int h, int xcount, int ycount) {
+    int wsep = w <= 2*xcount ? w / xcount : w / (xcount + 1);
+    int hsep = h / (ycount + 1);
+    int i, j;
+    for (i = 0; i < xcount; i++) {
+	int cx;
+	if (w <= xcount)
+	    cx = x + wsep * i;
+	else if (w <= 2*xcount)
+	    cx = 1 + x + wsep * i;
+	else
+	    cx = x + wsep * (i + 1);
+	for (j = 0; j < ycount; j++) {
+	    int cy = y + hsep * (j + 1);
+	    add_hub(gen, id(gen, cy, cx), x, y, w, h);
+	}
+    }
+}
+
+static void fracture(gen_t *gen, int x, int y, int w) {
+    if (w % 2 != 0) {
+	make_hubs(gen, x, y, w, w, 1, 1);
+	return;
+    }
+    int nw = w / 2;
+    make_hubs(gen, x, y, w, nw, 4, 1);
+    make_hubs(gen, x, y+nw, nw, nw, 1, 1);
+    fracture(gen, x+nw, y+nw, nw);
+}
+
+static void tile(gen_t *gen, int t) {
+    int x, y;
+    for (x = 0; x < gen->k; x += t) {
+	int w = t < gen->k - x ? t : gen->k - x;
+	for (y = 0; y <= gen->k - t; y += t) {
+	    int h = t < gen->k - y ? t : gen->k - y;
+	    make_hubs(gen, x, y, w, h, 1, 1);
+	}
+    }
+}
+
+static int compare_int(const void *a, const void *b) {
+    return *(int *) a - *(int *) b;
+}
+
+/* Add edge in both directions, either counting it or storing it */
+static inline void add_edge(int *degree, int *start, int *adj, int i, int j) {
+    if (i == j)
+	return;
+    if (adj == NULL) {
+	degree[i]++;
+	degree[j]++;
+    } else {
+	adj[start[i] + degree[i]++] = j;
+	adj[start[j] + degree[j]++] = i;
+    }
+}
+
+/* Generate all edges, first counting them, and then storing them */
+static void gather_edges(gen_t *gen, int *degree, int *start, int *adj) {
+    int k = gen->k;
+    int r, c, i, j, h;
+    memset(degree, 0, gen->nnode * sizeof(int));
+    for (r = 0; r < k; r++) {
+	for (c = 0; c < k; c++) {
+	    int own = id(gen, r, c);
+	    /* Grid edges get added from both ends, as in gengraph.py */
+	    int grid[4] = { id(gen, r-1, c), id(gen, r+1, c), id(gen, r, c-1), id(gen, r, c+1) };
+	    for (i = 0; i < 4; i++) {
+		if (grid[i] >= 0)
+		    add_edge(degree, start, adj, own, grid[i]);
+	    }
+	}
+    }
+    for (h = 0; h < gen->nhub; h++) {
+	hub_t *hub = &gen->hub[h];
+	for (j = 0; j < hub->w; j++)
+	    for (i = 0; i < hub->h; i++)
+		add_edge(degree, start, adj, hub->cid, id(gen, hub->y + i, hub->x + j));
+    }
+}
+
+/*
+  Build graph from grid and hubs.  Adjacency lists are sorted with
+  duplicates removed, and start with the self edge, as read_graph builds them
+ */
+static graph_t *build_graph(gen_t *gen) {
+    int nnode = gen->nnode;
+    int nid;
+    int *degree = int_alloc(nnode);
+    int *start = int_alloc(nnode + 1);
+    if (degree == NULL || start == NULL) {
+	outmsg("Couldn't allocate space for %d nodes\n", nnode);
+	return NULL;
+    }
+    gather_edges(gen, degree, start, NULL);
+    long total = 0;
+    for (nid = 0; nid < nnode; nid++) {
+	start[nid] = (int) total;
+	total += degree[nid];
+    }
+    start[nnode] = (int) total;
+    int *adj = page_alloc(total, sizeof(int));
+    if (adj == NULL || total > INT_MAX) {
+	outmsg("Couldn't allocate space for %ld edges\n", total);
+	return NULL;
+    }
+    gather_edges(gen, degree, start, adj);
+
+#if OMP
+#pragma omp parallel for schedule(dynamic, 256)
+#endif
+    for (nid = 0; nid < nnode; nid++) {
+	int *list = adj + start[nid];
+	int n = degree[nid];
+	int i, d = 0;
+	qsort(list, n, sizeof(int), compare_int);
+	for (i = 0; i < n; i++) {
+	    if (d == 0 || list[i] != list[d-1])
+		list[d++] = list[i];
+	}
+	degree[nid] = d;
+    }
+
+    int nedge = 0;
+    for (nid = 0; nid < nnode; nid++)
+	nedge += degree[nid];
+    graph_t *g = new_graph(nnode, nedge, gen->tile_max);
+    if (g == NULL)
+	return NULL;
+    int eid = 0;
+    for (nid = 0; nid < nnode; nid++) {
+	g->neighbor_start[nid] = eid;
+	eid += degree[nid] + 1;
+    }
+    g->neighbor_start[nnode] = eid;
+#if OMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (nid = 0; nid < nnode; nid++) {
+	int *list = g->neighbor + g->neighbor_start[nid];
+	list[0] = nid;
+	memcpy(list + 1, adj + start[nid], degree[nid] * sizeof(int));
+    }
+    page_free(adj, total, sizeof(int));
+    free(degree);
+    free(start);
+    return g;
+}
+
+/* Format nonnegative integer, followed by terminator */
+static inline char *format_int(char *p, int v, char term) {
+    char digits[12];
+    int n = 0;
+    do {
+	digits[n++] = '0' + v % 10;
+	v /= 10;
+    } while (v > 0);
+    while (n > 0)
+	*p++ = digits[--n];
+    *p++ = term;
+    return p;
+}
+
+/*
+  Write ints in chunks.  Each thread formats whole chunks, and the
+  chunks get written in order.  Format function puts text for item i
+  into buffer, and returns end of text
+ */
+typedef char *(*format_fun)(void *arg, int i, char *p);
+
+static bool write_chunks(FILE *outfile, int n, size_t max_len, format_fun fun, void *arg) {
+    int nchunk = (n + GEN_CHUNK - 1) / GEN_CHUNK;
+    int c;
+    bool ok = true;
+#if OMP
+#pragma omp parallel
+#endif
+    {
+	char *buf = malloc(GEN_CHUNK * max_len);
+	if (buf == NULL) {
+	    outmsg("Couldn't allocate output buffer\n");
+	    exit(1);
+	}
+#if OMP
+#pragma omp for ordered schedule(static, 1)
+#endif
+	for (c = 0; c < nchunk; c++) {
+	    int i;
+	    int hi = (c + 1) * GEN_CHUNK < n ? (c + 1) * GEN_CHUNK : n;
+	    char *p = buf;
+	    for (i = c * GEN_CHUNK; i < hi; i++)
+		p = fun(arg, i, p);
+#if OMP
+#pragma omp ordered
+#endif
+	    if (fwrite(buf, 1, p - buf, outfile) != (size_t) (p - buf))
+		ok = false;
+	}
+	free(buf);
+    }
+    return ok;
+}
+
+static char *format_node(void *arg, int nid, char *p) {
+    graph_t *g = (graph_t *) arg;
+    int eid;
+    /* Skip self edge */
+    for (eid = g->neighbor_start[nid] + 1; eid < g->neighbor_start[nid+1]; eid++) {
+	p = format_int(p, nid, ' ');
+	p = format_int(p, g->neighbor[eid], '\n');
+    }
+    return p;
+}
+
+static int max_degree(graph_t *g) {
+    int nid, max = 0;
+    for (nid = 0; nid < g->nnode; nid++) {
+	int d = g->neighbor_start[nid+1] - g->neighbor_start[nid];
+	if (d > max)
+	    max = d;
+    }
+    return max;
+}
+
+static bool write_text_graph(graph_t *g, FILE *outfile, char *type) {
+    time_t now = time(NULL);
+    fprintf(outfile, "%d %d %d\n", g->nnode, g->nedge, g->tile_max);
+    fprintf(outfile, "# Generated %s", ctime(&now));
+    fprintf(outfile, "# Parameters: k = %d, %s\n", g->nrow, type);
+    return write_chunks(outfile, g->nnode, (size_t) max_degree(g) * 24, format_node, g);
+}
+
+static char *format_rat(void *arg, int ri, char *p) {
+    return format_int(p, ((int *) arg)[ri], '\n');
+}
+
+/*
+  Fill in positions for nrat rats, cycling through nlist starting
+  nodes, and then shuffle them as gengraph.py's RNG.permute does.
+  The draws are computed in parallel blocks, using the ability to
+  skip ahead in the random sequence, and then applied in order
+ */
+static bool place_rats(int *rat_position, int nrat, int *list, int nlist, random_t seed) {
+    int *order = int_alloc(nrat);
+    int *pick = int_alloc(DRAW_BLOCK);
+    random_t rseed;
+    long d;
+    int ri;
+    if (order == NULL || pick == NULL) {
+	outmsg("Couldn't allocate space for %d rats\n", nrat);
+	return false;
+    }
+    reseed(&rseed, &seed, 1);
+    for (ri = 0; ri < nrat; ri++)
+	order[ri] = ri;
+    /* Draw d picks from among the first nrat-d entries */
+    for (d = 0; d < nrat - 1; d += DRAW_BLOCK) {
+	int bcount = nrat - 1 - d < DRAW_BLOCK ? (int) (nrat - 1 - d) : DRAW_BLOCK;
+	int i;
+#if OMP
+#pragma omp parallel private(i)
+#endif
+	{
+	    int tid = 0, nthread = 1;
+#if OMP
+	    tid = omp_get_thread_num();
+	    nthread = omp_get_num_threads();
+#endif
+	    int lo = (int) (((long) bcount * tid) / nthread);
+	    int hi = (int) (((long) bcount * (tid+1)) / nthread);
+	    random_t tseed = rseed;
+	    skip_random(&tseed, lo);
+	    for (i = lo; i < hi; i++) {
+		long n = nrat - (d + i);
+		pick[i] = (int) (next_random_float(&tseed, 1.0) * n);
+	    }
+	}
+	skip_random(&rseed, bcount);
+	for (i = 0; i < bcount; i++) {
+	    int last = (int) (nrat - 1 - (d + i));
+	    int t = order[pick[i]];
+	    order[pick[i]] = order[last];
+	    order[last] = t;
+	}
+    }
+#if OMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (ri = 0; ri < nrat; ri++)
+	rat_position[ri] = list[order[ri] % nlist];
+    free(order);
+    free(pick);
+    return true;
+}
+
+static bool write_rat_file(graph_t *g, FILE *outfile, rat_mode_t mode, int load, random_t seed, bool binary) {
+    int k = g->nrow;
+    int nnode = g->nnode;
+    int nlist = mode == RAT_UNIFORM ? nnode : mode == RAT_DIAGONAL ? k : 1;
+    int *list = int_alloc(nlist);
+    int i;
+    if (list == NULL) {
+	outmsg("Couldn't allocate space for rat list\n");
+	return false;
+    }
+    for (i = 0; i < nlist; i++) {
+	switch (mode) {
+	case RAT_UNIFORM:
+	    list[i] = i;
+	    break;
+	case RAT_DIAGONAL:
+	    list[i] = (k+1) * i;
+	    break;
+	case RAT_UPLEFT:
+	    list[i] = 0;
+	    break;
+	case RAT_LOWRIGHT:
+	    list[i] = nnode - 1;
+	    break;
+	}
+    }
+    long factor = (long) nnode * load / nlist;
+    if ((long) nlist * factor > INT_MAX) {
+	outmsg("Too many rats: %ld\n", (long) nlist * factor);
+	return false;
+    }
+    int nrat = (int) (nlist * factor);
+    int *rat_position = page_alloc(nrat, sizeof(int));
+    if (rat_position == NULL) {
+	outmsg("Couldn't allocate space for %d rats\n", nrat);
+	return false;
+    }
+    bool ok = place_rats(rat_position, nrat, list, nlist, seed);
+    if (ok && binary)
+	ok = write_positions(nnode, nrat, rat_position, outfile);
+    else if (ok) {
+	time_t now = time(NULL);
+	fprintf(outfile, "%d %d\n", nnode, nrat);
+	fprintf(outfile, "# Generated %s", ctime(&now));
+	fprintf(outfile, "# Parameters: load = %d, mode = %s, seed = %u\n", load, mode_names[mode], seed);
+	ok = write_chunks(outfile, nrat, 12, format_rat, rat_position);
+    }
+    if (ok)
+	outmsg("Generated %d rats\n", nrat);
+    page_free(rat_position, nrat, sizeof(int));
+    free(list);
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    gen_t gen;
+    int k = 10;
+    bool fractal = false;
+    int t = 0;
+    char *gname = NULL;
+    char *rname = NULL;
+    int load = 1;
+    rat_mode_t mode = RAT_UNIFORM;
+    random_t seed = DEFAULTSEED;
+    bool binary = false;
+    int c;
+
+    char *optstring = "hk:ft:o:r:l:m:s:bT:";
+    while ((c = getopt(argc, argv, optstring)) != -1) {
+	switch(c) {
+	case 'h':
+	    usage(argv[0]);
+	    break;
+	case 'k':
+	    k = atoi(optarg);
+	    break;
+	case 'f':
+	    fractal = true;
+	    break;
+	case 't':
+	    t = atoi(optarg);
+	    break;
+	case 'o':
+	    gname = optarg;
+	    break;
+	case 'r':
+	    rname = optarg;
+	    break;
+	case 'l':
+	    load = atoi(optarg);
+	    break;
+	case 'm':
+	    if (optarg[0] == 'u')
+		mode = RAT_UNIFORM;
+	    else if (optarg[0] == 'd')
+		mode = RAT_DIAGONAL;
+	    else if (optarg[0] == 'l')
+		mode = RAT_UPLEFT;
+	    else if (optarg[0] == 'r')
+		mode = RAT_LOWRIGHT;
+	    else {
+		outmsg("Invalid rat mode '%c'\n", optarg[0]);
+		usage(argv[0]);
+	    }
+	    break;
+	case 's':
+	    seed = strtoul(optarg, NULL, 0);
+	    break;
+	case 'b':
+	    binary = true;
+	    break;
+	case 'T':
+#if OMP
+	    omp_set_num_threads(atoi(optarg));
+#else
+	    outmsg("Compiled without OpenMP.  Using 1 thread\n");
+#endif
+	    break;
+	default:
+	    outmsg("Unknown option '%c'\n", c);
+	    usage(argv[0]);
+	}
+    }
+    if (k <= 0 || load <= 0) {
+	outmsg("Need positive grid size and load\n");
+	usage(argv[0]);
+    }
+    if ((long) k * k > INT_MAX) {
+	outmsg("Grid with k = %d too large\n", k);
+	exit(1);
+    }
+
+    memset(&gen, 0, sizeof(gen));
+    gen.k = k;
+    gen.nnode = k * k;
+    gen.tile_max = 1;
+    if (fractal) {
+	fracture(&gen, 0, 0, k);
+	gen.tile_max = k / 2;
+    }
+    if (t > 0) {
+	tile(&gen, t);
+	gen.tile_max = t;
+    }
+    graph_t *g = build_graph(&gen);
+    if (g == NULL)
+	exit(1);
+    outmsg("Generated graph with %d nodes and %d edges\n", g->nnode, g->nedge);
+
+    FILE *gfile = gname == NULL ? stdout : open_file(gname, "w");
+    char *type = fractal ? "fractal" : t > 1 ? "tiled" : "uniform";
+    bool ok = binary ? write_graph(g, gfile) : write_text_graph(g, gfile, type);
+    if (gfile != stdout && fclose(gfile) != 0)
+	ok = false;
+    if (!ok) {
+	outmsg("Couldn't write graph file\n");
+	exit(1);
+    }
+    if (rname != NULL) {
+	FILE *rfile = open_file(rname, "w");
+	ok = write_rat_file(g, rfile, mode, load, seed, binary);
+	if (fclose(rfile) != 0)
+	    ok = false;
+	if (!ok) {
+	    outmsg("Couldn't write rat file %s\n", rname);
+	    exit(1);
+	}
+    }
+    free(gen.hub);
+    free_graph(g);
+    return 0;
+}
@@ -1,11 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "crun.h"
 
-graph_t *new_graph(int nnode, int nedge, int tile_max) {
-    bool ok = true;
+/* Allocate graph, without allocating its adjacency structure */
+static graph_t *new_graph_header(int nnode, int nedge, int tile_max) {
     graph_t *g = malloc(sizeof(graph_t));
     if (g == NULL)
 	return NULL;
@@ -13,15 +15,34 @@ graph_t *new_graph(int nnode, int nedge, int tile_max) {
     g->nrow = (int) sqrt(g->nnode);
     g->tile_max = tile_max > 0 ? tile_max : g->nrow;
     g->nedge = nedge;
-    g->neighbor = calloc(nnode + nedge, sizeof(int));
+    g->neighbor = NULL;
+    g->neighbor_start = NULL;
+    g->neighbor16 = NULL;
+    g->map = NULL;
+    g->map_len = 0;
+    g->node_order = NULL;
+    g->node_rank = NULL;
+    g->shared = false;
+    g->gsums = page_alloc(nnode + nedge, sizeof(double));
+    if (g->gsums == NULL) {
+	free(g);
+	return NULL;
+    }
+    return g;
+}
+
+graph_t *new_graph(int nnode, int nedge, int tile_max) {
+    bool ok = true;
+    graph_t *g = new_graph_header(nnode, nedge, tile_max);
+    if (g == NULL) {
+	outmsg("Couldn't allocate graph data structures");
+	return NULL;
+    }
+    g->neighbor = page_alloc(nnode + nedge, sizeof(int));
     ok = ok && g->neighbor != NULL;
     g->neighbor_start = calloc(nnode + 1, sizeof(int));
     ok = ok && g->neighbor_start != NULL;
 
-    g->gsums = calloc(nnode + nedge, sizeof(double));
-    ok = ok && g->gsums != NULL;
-
-
     if (!ok) {
 	outmsg("Couldn't allocate graph data structures");
 	return NULL;
@@ -30,12 +51,232 @@ graph_t *new_graph(int nnode, int nedge, int tile_max) {
 }
 
 void free_graph(graph_t *g) {
-    free(g->neighbor);
-    free(g->neighbor_start);
-    free(g->gsums);
+    /* Shared adjacency structure belongs to another graph or to shared memory */
+    if (!g->shared) {
+	if (g->map != NULL) {
+	    munmap(g->map, g->map_len);
+	} else {
+	    page_free(g->neighbor, g->nnode + g->nedge, sizeof(int));
+	    free(g->neighbor_start);
+	}
+	page_free(g->neighbor16, g->nnode + g->nedge, sizeof(uint16_t));
+    }
+    page_free(g->gsums, g->nnode + g->nedge, sizeof(double));
+    free(g->node_order);
+    free(g->node_rank);
     free(g);
 }
 
+graph_t *share_graph(graph_t *g) {
+    graph_t *sg = malloc(sizeof(graph_t));
+    if (sg == NULL)
+	return NULL;
+    *sg = *g;
+    sg->shared = true;
+    sg->gsums = page_alloc(g->nnode + g->nedge, sizeof(double));
+    /* Each graph owns its renumbering */
+    sg->node_order = NULL;
+    sg->node_rank = NULL;
+    if (g->node_order != NULL) {
+	sg->node_order = int_alloc(g->nnode);
+	sg->node_rank = int_alloc(g->nnode);
+    }
+    if (sg->gsums == NULL || (g->node_order != NULL && (sg->node_order == NULL || sg->node_rank == NULL))) {
+	free_graph(sg);
+	return NULL;
+    }
+    if (g->node_order != NULL) {
+	memcpy(sg->node_order, g->node_order, g->nnode * sizeof(int));
+	memcpy(sg->node_rank, g->node_rank, g->nnode * sizeof(int));
+    }
+    return sg;
+}
+
+#if MPI
+/* Shared memory holding the adjacency structure on this machine */
+static MPI_Win graph_win = MPI_WIN_NULL;
+
+/* Release storage for adjacency structure, once it has been copied elsewhere */
+static void free_structure(graph_t *g) {
+    if (g->map != NULL)
+	munmap(g->map, g->map_len);
+    else {
+	page_free(g->neighbor, g->nnode + g->nedge, sizeof(int));
+	free(g->neighbor_start);
+    }
+    page_free(g->neighbor16, g->nnode + g->nedge, sizeof(uint16_t));
+    g->map = NULL;
+    g->map_len = 0;
+}
+
+graph_t *distribute_graph(graph_t *g, int nnode, int nedge, int tile_max) {
+    MPI_Comm node_comm, leader_comm;
+    int node_rank;
+    int eid;
+
+    if (g == NULL) {
+	g = new_graph_header(nnode, nedge, tile_max);
+	/* The other processes are waiting in collective operations */
+	if (g == NULL) {
+	    outmsg("Couldn't allocate graph data structures\n");
+	    MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+    }
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node_comm);
+    MPI_Comm_rank(node_comm, &node_rank);
+    /* One leader per machine.  The master leads its own */
+    MPI_Comm_split(MPI_COMM_WORLD, node_rank == 0 ? 0 : MPI_UNDEFINED, 0, &leader_comm);
+
+    /* Segment holds neighbor_start, and then the adjacency lists with 16-bit node Ids when they fit */
+    bool narrow = nnode <= NARROW_NODE_LIMIT;
+    size_t start_len = BINARY_ROUND((size_t) (nnode + 1) * sizeof(int));
+    size_t len = start_len + (size_t) (nnode + nedge) * (narrow ? sizeof(uint16_t) : sizeof(int));
+    char *base;
+    MPI_Win_allocate_shared(node_rank == 0 ? len : 0, 1, MPI_INFO_NULL, node_comm, &base, &graph_win);
+    if (node_rank != 0) {
+	MPI_Aint qlen;
+	int disp;
+	MPI_Win_shared_query(graph_win, 0, &qlen, &disp, &base);
+    }
+    int *neighbor_start = (int *) base;
+    int *neighbor = narrow ? NULL : (int *) (base + start_len);
+    uint16_t *neighbor16 = narrow ? (uint16_t *) (base + start_len) : NULL;
+
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, graph_win);
+    if (g->neighbor_start != NULL) {
+	/* Master has the graph as read from the file */
+	memcpy(neighbor_start, g->neighbor_start, (size_t) (nnode + 1) * sizeof(int));
+	if (narrow) {
+	    for (eid = 0; eid < nnode + nedge; eid++)
+		neighbor16[eid] = (uint16_t) graph_neighbor(g, eid);
+	} else
+	    memcpy(neighbor, g->neighbor, (size_t) (nnode + nedge) * sizeof(int));
+	free_structure(g);
+    }
+    if (leader_comm != MPI_COMM_NULL) {
+	MPI_Bcast(neighbor_start, nnode + 1, MPI_INT, 0, leader_comm);
+	if (narrow)
+	    MPI_Bcast(neighbor16, nnode + nedge, MPI_UINT16_T, 0, leader_comm);
+	else
+	    MPI_Bcast(neighbor, nnode + nedge, MPI_INT, 0, leader_comm);
+	MPI_Comm_free(&leader_comm);
+    }
+    /* Make the leader's stores visible to the other processes on the machine */
+    MPI_Win_sync(graph_win);
+    MPI_Barrier(node_comm);
+    MPI_Win_sync(graph_win);
+    MPI_Win_unlock_all(graph_win);
+    MPI_Comm_free(&node_comm);
+
+    g->neighbor_start = neighbor_start;
+    g->neighbor = neighbor;
+    g->neighbor16 = neighbor16;
+    g->shared = true;
+    return g;
+}
+
+void free_graph_window() {
+    if (graph_win != MPI_WIN_NULL)
+	MPI_Win_free(&graph_win);
+}
+#endif
+
+/*
+  Check adjacency structure of mapped file: lists in order, each
+  starting with its self edge, and all neighbors valid nodes
+ */
+static bool check_mapped_graph(graph_t *g) {
+    int nnode = g->nnode;
+    int nid, eid;
+    if (g->neighbor_start[0] != 0 || g->neighbor_start[nnode] != nnode + g->nedge) {
+	outmsg("ERROR. Inconsistent binary graph file\n");
+	return false;
+    }
+    for (nid = 0; nid < nnode; nid++) {
+	int lo = g->neighbor_start[nid];
+	int hi = g->neighbor_start[nid+1];
+	if (hi <= lo || hi > nnode + g->nedge) {
+	    outmsg("ERROR. Node %d.  Invalid adjacency list [%d, %d)\n", nid, lo, hi);
+	    return false;
+	}
+	if (g->neighbor[lo] != nid) {
+	    outmsg("ERROR. Node %d.  Adjacency list doesn't start with self edge\n", nid);
+	    return false;
+	}
+	for (eid = lo + 1; eid < hi; eid++) {
+	    if (g->neighbor[eid] < 0 || g->neighbor[eid] >= nnode) {
+		outmsg("ERROR. Node %d.  Invalid neighbor %d\n", nid, g->neighbor[eid]);
+		return false;
+	    }
+	}
+    }
+    return true;
+}
+
+/* Map binary graph file into memory.  Header has already been checked for magic number */
+static graph_t *map_graph(FILE *infile) {
+    binary_header_t h;
+    struct stat st;
+
+    rewind(infile);
+    if (fread(&h, sizeof(h), 1, infile) != 1 || h.version != BINARY_VERSION ||
+	h.nnode < 1 || h.nedge < 0) {
+	outmsg("ERROR. Malformed binary graph file header\n");
+	return NULL;
+    }
+    size_t start_off = sizeof(h);
+    size_t neighbor_off = start_off + BINARY_ROUND((h.nnode + 1) * sizeof(int));
+    size_t len = neighbor_off + (size_t) (h.nnode + h.nedge) * sizeof(int);
+    if (fstat(fileno(infile), &st) != 0 || (size_t) st.st_size < len) {
+	outmsg("ERROR. Binary graph file truncated\n");
+	return NULL;
+    }
+    /* Private mapping, so that the arrays can be modified in place */
+    void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(infile), 0);
+    if (map == MAP_FAILED) {
+	outmsg("ERROR. Couldn't map binary graph file\n");
+	return NULL;
+    }
+    graph_t *g = new_graph_header(h.nnode, h.nedge, h.tile_max);
+    if (g == NULL) {
+	outmsg("Couldn't allocate graph data structures");
+	munmap(map, len);
+	return NULL;
+    }
+    g->map = map;
+    g->map_len = len;
+    g->neighbor_start = (int *) ((char *) map + start_off);
+    g->neighbor = (int *) ((char *) map + neighbor_off);
+    if (!check_mapped_graph(g)) {
+	/* Unmaps file */
+	free_graph(g);
+	return NULL;
+    }
+    outmsg("Mapped graph with %d nodes and %d edges\n", g->nnode, g->nedge);
+    return g;
+}
+
+/* Write out n bytes, followed by zero padding up to the next alignment boundary */
+static bool write_padded(void *data, size_t n, FILE *outfile) {
+    static char zeros[BINARY_ALIGN];
+    size_t pad = BINARY_ROUND(n) - n;
+    return fwrite(data, 1, n, outfile) == n && fwrite(zeros, 1, pad, outfile) == pad;
+}
+
+/* Write graph in binary format */
+bool write_graph(graph_t *g, FILE *outfile) {
+    binary_header_t h;
+    memset(&h, 0, sizeof(h));
+    h.magic = GRAPH_MAGIC;
+    h.version = BINARY_VERSION;
+    h.nnode = g->nnode;
+    h.nedge = g->nedge;
+    h.tile_max = g->tile_max;
+    return write_padded(&h, sizeof(h), outfile)
+	&& write_padded(g->neighbor_start, (g->nnode + 1) * sizeof(int), outfile)
+	&& write_padded(g->neighbor, (g->nnode + g->nedge) * sizeof(int), outfile);
+}
+
 /* See whether line of text is a comment */
 static inline bool is_comment(char *s) {
     int i;
@@ -55,6 +296,11 @@ graph_t *read_graph(FILE *infile) {
     int tile_max = 0;
     int i, hid, tid;
     int nid, eid;
+    uint32_t magic;
+
+    if (fread(&magic, sizeof(magic), 1, infile) == 1 && magic == GRAPH_MAGIC)
+	return map_graph(infile);
+    rewind(infile);
 
     // Read header information
     while (fgets(linebuf, MAXLINE, infile) != NULL) {
@@ -116,6 +362,224 @@ graph_t *read_graph(FILE *infile) {
     return g;
 }
 
+/* Compare keys for sorting */
+static int compare_long(const void *a, const void *b) {
+    long x = *(const long *) a;
+    long y = *(const long *) b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static inline int degree(graph_t *g, int nid) {
+    return g->neighbor_start[nid+1] - g->neighbor_start[nid];
+}
+
+/*
+  Reverse Cuthill-McKee ordering.  Breadth-first search from a node of
+  minimum degree in each component, visiting neighbors in order of
+  increasing degree, and then reverse the resulting order
+ */
+static bool rcm_order(graph_t *g, int *order) {
+    int nnode = g->nnode;
+    int i, j, eid;
+    int head = 0, tail = 0;
+    long *key = calloc(nnode, sizeof(long));
+    long *nkey = calloc(nnode, sizeof(long));
+    bool *visited = calloc(nnode, sizeof(bool));
+    bool ok = key != NULL && nkey != NULL && visited != NULL;
+
+    if (ok) {
+	/* Candidate starting points, by increasing degree */
+	for (i = 0; i < nnode; i++)
+	    key[i] = ((long) degree(g, i) << 32) | i;
+	qsort(key, nnode, sizeof(long), compare_long);
+
+	for (i = 0; i < nnode; i++) {
+	    int root = (int) (key[i] & 0xFFFFFFFF);
+	    if (visited[root])
+		continue;
+	    visited[root] = true;
+	    order[tail++] = root;
+	    while (head < tail) {
+		int nid = order[head++];
+		int n = 0;
+		for (eid = g->neighbor_start[nid]; eid < g->neighbor_start[nid+1]; eid++) {
+		    int nnid = graph_neighbor(g, eid);
+		    if (!visited[nnid]) {
+			visited[nnid] = true;
+			nkey[n++] = ((long) degree(g, nnid) << 32) | nnid;
+		    }
+		}
+		qsort(nkey, n, sizeof(long), compare_long);
+		for (j = 0; j < n; j++)
+		    order[tail++] = (int) (nkey[j] & 0xFFFFFFFF);
+	    }
+	}
+
+	/* Reverse */
+	for (i = 0; i < nnode / 2; i++) {
+	    int t = order[i];
+	    order[i] = order[nnode-1-i];
+	    order[nnode-1-i] = t;
+	}
+    }
+    free(key);
+    free(nkey);
+    free(visited);
+    return ok;
+}
+
+/* Position of (x, y) along Hilbert curve filling n x n square, where n is a power of 2 */
+static long hilbert_index(int n, int x, int y) {
+    long d = 0;
+    int s;
+    for (s = n/2; s > 0; s /= 2) {
+	int rx = (x & s) > 0;
+	int ry = (y & s) > 0;
+	d += (long) s * s * ((3 * rx) ^ ry);
+	/* Rotate quadrant */
+	if (ry == 0) {
+	    if (rx == 1) {
+		x = n-1 - x;
+		y = n-1 - y;
+	    }
+	    int t = x;
+	    x = y;
+	    y = t;
+	}
+    }
+    return d;
+}
+
+/* Order grid nodes along a Hilbert curve.  Requires square grid */
+static bool hilbert_order(graph_t *g, int *order) {
+    int nnode = g->nnode;
+    int k = g->nrow;
+    int n = 1;
+    int nid;
+    if (k * k != nnode)
+	return false;
+    while (n < k)
+	n *= 2;
+    long *key = calloc(nnode, sizeof(long));
+    if (key == NULL)
+	return false;
+    for (nid = 0; nid < nnode; nid++)
+	key[nid] = (hilbert_index(n, nid % k, nid / k) << 32) | nid;
+    qsort(key, nnode, sizeof(long), compare_long);
+    for (nid = 0; nid < nnode; nid++)
+	order[nid] = (int) (key[nid] & 0xFFFFFFFF);
+    free(key);
+    return true;
+}
+
+/*
+  Renumber nodes to improve locality.  Adjacency lists keep their
+  original order, so that simulation results are unchanged
+ */
+bool reorder_graph(graph_t *g, order_t order) {
+    int nnode = g->nnode;
+    int nid, eid;
+    bool ok = true;
+
+    if (order == ORDER_NONE)
+	return true;
+    int *node_order = int_alloc(nnode);
+    int *node_rank = int_alloc(nnode);
+    int *neighbor = page_alloc(nnode + g->nedge, sizeof(int));
+    int *neighbor_start = int_alloc(nnode + 1);
+    ok = node_order != NULL && node_rank != NULL && neighbor != NULL && neighbor_start != NULL;
+    if (ok) {
+	if (order == ORDER_RCM)
+	    ok = rcm_order(g, node_order);
+	else
+	    ok = hilbert_order(g, node_order);
+	if (!ok)
+	    outmsg("Couldn't renumber graph nodes.  Keeping original numbering\n");
+    } else
+	outmsg("Couldn't allocate space to renumber graph\n");
+    if (!ok) {
+	free(node_order);
+	free(node_rank);
+	page_free(neighbor, nnode + g->nedge, sizeof(int));
+	free(neighbor_start);
+	return false;
+    }
+
+    for (nid = 0; nid < nnode; nid++)
+	node_rank[node_order[nid]] = nid;
+    int neid = 0;
+    for (nid = 0; nid < nnode; nid++) {
+	int onid = node_order[nid];
+	neighbor_start[nid] = neid;
+	for (eid = g->neighbor_start[onid]; eid < g->neighbor_start[onid+1]; eid++)
+	    neighbor[neid++] = node_rank[graph_neighbor(g, eid)];
+    }
+    neighbor_start[nnode] = neid;
+
+    if (g->map != NULL) {
+	munmap(g->map, g->map_len);
+	g->map = NULL;
+	g->map_len = 0;
+    } else {
+	page_free(g->neighbor, nnode + g->nedge, sizeof(int));
+	free(g->neighbor_start);
+    }
+    page_free(g->neighbor16, nnode + g->nedge, sizeof(uint16_t));
+    g->neighbor16 = NULL;
+    g->neighbor = neighbor;
+    g->neighbor_start = neighbor_start;
+    g->node_order = node_order;
+    g->node_rank = node_rank;
+    outmsg("Renumbered graph nodes using %s ordering\n", order == ORDER_RCM ? "RCM" : "Hilbert");
+    return true;
+}
+
+bool narrow_graph(graph_t *g) {
+    int eid;
+    if (g->neighbor16 != NULL)
+	return true;
+    /* Borrowed structure belongs to another graph */
+    if (g->nnode > NARROW_NODE_LIMIT || g->shared)
+	return false;
+    g->neighbor16 = page_alloc(g->nnode + g->nedge, sizeof(uint16_t));
+    if (g->neighbor16 == NULL)
+	return false;
+    for (eid = 0; eid < g->nnode + g->nedge; eid++)
+	g->neighbor16[eid] = (uint16_t) g->neighbor[eid];
+    /* A mapped file is released as a whole, and its unused pages are never touched */
+    if (g->map == NULL)
+	page_free(g->neighbor, g->nnode + g->nedge, sizeof(int));
+    g->neighbor = NULL;
+    return true;
+}
+
+/* FNV-1a hash, one 32-bit word at a time */
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME  0x100000001b3ULL
+
+static inline uint64_t hash_word(uint64_t h, int v) {
+    return (h ^ (uint32_t) v) * FNV_PRIME;
+}
+
+/* Hash of graph structure, using the numbering from the graph file */
+uint64_t graph_fingerprint(graph_t *g) {
+    int onid, eid;
+    uint64_t h = FNV_OFFSET;
+    h = hash_word(h, g->nnode);
+    h = hash_word(h, g->nedge);
+    for (onid = 0; onid < g->nnode; onid++) {
+	int nid = g->node_rank == NULL ? onid : g->node_rank[onid];
+	int lo = g->neighbor_start[nid];
+	int hi = g->neighbor_start[nid+1];
+	h = hash_word(h, hi - lo);
+	for (eid = lo; eid < hi; eid++) {
+	    int nnid = graph_neighbor(g, eid);
+	    h = hash_word(h, g->node_order == NULL ? nnid : g->node_order[nnid]);
+	}
+    }
+    return h;
+}
+
 #if DEBUG
 void show_graph(graph_t *g) {
     int nid, eid;
@@ -123,7 +587,7 @@ void show_graph(graph_t *g) {
     for (nid = 0; nid < g->nnode; nid++) {
 	outmsg("%d:", nid);
 	for (eid = g->neighbor_start[nid]; eid < g->neighbor_start[nid+1]; eid++) {
-	    outmsg(" %d", g->neighbor[eid]);
+	    outmsg(" %d", graph_neighbor(g, eid));
 	}
 	outmsg("\n");
     }
@@ -0,0 +1,109 @@
+/*
+  Shared library interface to the simulator.  Runs the same code as
+  crun, without any output stage, so that each step only updates the
+  simulation state.
+*/
+
+#include "crun.h"
+#include "graphrat.h"
+
+struct graphrat {
+    graph_t *g;
+    state_t *s;
+    update_t update_mode;
+};
+
+int gr_api_version() {
+    return GRAPHRAT_API_VERSION;
+}
+
+graphrat_t *gr_open(const char *gfile, const char *rfile, unsigned seed, char update, int nthread) {
+    update_t update_mode;
+    switch (update) {
+    case 's':
+	update_mode = UPDATE_SYNCHRONOUS;
+	break;
+    case 'r':
+	update_mode = UPDATE_RAT;
+	break;
+    case 'b':
+	update_mode = UPDATE_BATCH;
+	break;
+    default:
+	outmsg("Invalid update mode '%c'\n", update);
+	return NULL;
+    }
+
+    FILE *infile = fopen(gfile, "r");
+    if (infile == NULL) {
+	outmsg("Couldn't open graph file %s\n", gfile);
+	return NULL;
+    }
+    graph_t *g = read_graph(infile);
+    fclose(infile);
+    if (g == NULL)
+	return NULL;
+
+    infile = fopen(rfile, "r");
+    if (infile == NULL) {
+	outmsg("Couldn't open rat position file %s\n", rfile);
+	free_graph(g);
+	return NULL;
+    }
+    state_t *s = read_rats(g, infile, seed);
+    fclose(infile);
+    if (s == NULL) {
+	free_graph(g);
+	return NULL;
+    }
+
+    graphrat_t *gr = malloc(sizeof(graphrat_t));
+    if (gr == NULL) {
+	outmsg("Couldn't allocate simulation handle\n");
+	free_rats(s);
+	free_graph(g);
+	return NULL;
+    }
+#if OMP
+    s->nthread = nthread < 1 ? 1 : nthread;
+#else
+    s->nthread = 1;
+#endif
+    take_census(s);
+    gr->g = g;
+    gr->s = s;
+    gr->update_mode = update_mode;
+    return gr;
+}
+
+int gr_step(graphrat_t *gr, int nstep) {
+    if (nstep > 0)
+	simulate(gr->s, gr->s->step + nstep, gr->update_mode, nstep, false);
+    return gr->s->step;
+}
+
+int gr_step_count(graphrat_t *gr) {
+    return gr->s->step;
+}
+
+int gr_node_count(graphrat_t *gr) {
+    return gr->g->nnode;
+}
+
+int gr_rat_count(graphrat_t *gr) {
+    return gr->s->nrat;
+}
+
+const int *gr_counts(graphrat_t *gr) {
+    return gr->s->rat_count;
+}
+
+const int *gr_positions(graphrat_t *gr) {
+    return gr->s->rat_position;
+}
+
+void gr_close(graphrat_t *gr) {
+    free_rats(gr->s);
+    free_graph(gr->g);
+    free(gr);
+}
@@ -0,0 +1,47 @@
+#ifndef GRAPHRAT_H
+/*
+  C API to the GraphRats simulator, built as libgraphrat.so.  Lets
+  other programs, including the Python tools through ctypes (see
+  graphrat.py), load a graph & rats and run the simulation step by
+  step.  The simulation is held by an opaque handle.  Nodes have the
+  numbering from the graph file.
+*/
+
+/* Changes whenever the functions below change incompatibly */
+#define GRAPHRAT_API_VERSION 1
+
+typedef struct graphrat graphrat_t;
+
+/* Library is built with hidden symbols, except for these functions */
+#define GR_API __attribute__((visibility("default")))
+
+GR_API int gr_api_version();
+
+/*
+  Load graph & rat files, in text or binary format.  Update mode is
+  's' (synchronous), 'r' (rat order), or 'b' (batch).  Threads are
+  only used when the library is built with OpenMP.  Returns NULL on
+  failure, with a message on stderr
+ */
+GR_API graphrat_t *gr_open(const char *gfile, const char *rfile, unsigned seed, char update, int nthread);
+
+/* Run nstep more steps.  Returns number of steps taken so far */
+GR_API int gr_step(graphrat_t *gr, int nstep);
+
+/* Number of steps taken so far */
+GR_API int gr_step_count(graphrat_t *gr);
+GR_API int gr_node_count(graphrat_t *gr);
+GR_API int gr_rat_count(graphrat_t *gr);
+
+/*
+  Rat count for each node and node of each rat.  These point into the
+  simulation state, so they are updated in place by each step, and
+  remain valid until gr_close
+ */
+GR_API const int *gr_counts(graphrat_t *gr);
+GR_API const int *gr_positions(graphrat_t *gr);
+
+GR_API void gr_close(graphrat_t *gr);
+
+#define GRAPHRAT_H
+#endif
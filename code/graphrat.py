@@ -0,0 +1,92 @@
+# Python interface to the C simulator in libgraphrat.so (see graphrat.h)
+#
+# Runs the simulation in-process, one or more steps at a time.  The
+# rat counts are a view of the simulator's own array, with no copying
+# or text formatting.  They are updated in place by each step.
+
+import ctypes
+import os.path
+
+import rutil
+
+libName = "libgraphrat.so"
+apiVersion = 1
+
+# Some installations don't support numpy library.
+# Use it for views of the counts when available
+try:
+    import numpy as np
+except ImportError:
+    np = None
+
+lib = None
+
+def loadLibrary():
+    global lib
+    if lib is not None:
+        return lib
+    path = os.path.join(os.path.dirname(os.path.abspath(__file__)), libName)
+    lib = ctypes.CDLL(path)
+    lib.gr_api_version.restype = ctypes.c_int
+    lib.gr_open.restype = ctypes.c_void_p
+    lib.gr_open.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.c_uint, ctypes.c_char, ctypes.c_int]
+    for name in ["gr_step"]:
+        getattr(lib, name).argtypes = [ctypes.c_void_p, ctypes.c_int]
+    for name in ["gr_step", "gr_step_count", "gr_node_count", "gr_rat_count"]:
+        getattr(lib, name).restype = ctypes.c_int
+    for name in ["gr_step_count", "gr_node_count", "gr_rat_count", "gr_counts", "gr_positions", "gr_close"]:
+        getattr(lib, name).argtypes = [ctypes.c_void_p]
+    for name in ["gr_counts", "gr_positions"]:
+        getattr(lib, name).restype = ctypes.POINTER(ctypes.c_int)
+    lib.gr_close.restype = None
+    if lib.gr_api_version() != apiVersion:
+        raise Exception("%s has API version %d.  Expected %d" % (path, lib.gr_api_version(), apiVersion))
+    return lib
+
+# View n ints starting at pointer p, as numpy array if possible
+def intView(p, n):
+    if np is not None:
+        return np.ctypeslib.as_array(p, shape = (n,))
+    return ctypes.cast(p, ctypes.POINTER(ctypes.c_int * n)).contents
+
+class Engine:
+    handle = None
+
+    # Update mode is one of 's', 'r', 'b'
+    def __init__(self, gfname, rfname, seed = rutil.DEFAULTSEED, update = 'b', threads = 1):
+        loadLibrary()
+        self.handle = lib.gr_open(gfname.encode(), rfname.encode(), seed, update.encode(), threads)
+        if self.handle is None:
+            raise Exception("Couldn't load graph '%s' and rats '%s'" % (gfname, rfname))
+        self.nnode = lib.gr_node_count(self.handle)
+        self.nrat = lib.gr_rat_count(self.handle)
+        self.countView = intView(lib.gr_counts(self.handle), self.nnode)
+        self.positionView = intView(lib.gr_positions(self.handle), self.nrat)
+
+    # Run more steps.  Returns number of steps taken so far
+    def step(self, stepCount = 1):
+        return lib.gr_step(self.handle, stepCount)
+
+    def stepNumber(self):
+        return lib.gr_step_count(self.handle)
+
+    def nodeCount(self):
+        return self.nnode
+
+    def ratCount(self):
+        return self.nrat
+
+    # Rat count at each node.  Valid until close
+    def counts(self):
+        return self.countView
+
+    # Node of each rat.  Valid until close
+    def positions(self):
+        return self.positionView
+
+    def close(self):
+        if self.handle is not None:
+            lib.gr_close(self.handle)
+            self.handle = None
+            self.countView = None
+            self.positionView = None
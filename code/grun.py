@@ -10,12 +10,14 @@ import rutil
 import gengraph
 import sim
 import viz
+import graphrat
 
 def usage(name):
-    print "Usage: %s [-h] [-d] [-g GFILE] [-r RFILE] [-n STEPS] [-s SEED] [-u (s|r|b)] [-i INT] [-m (q|s|d)] [-p PERIOD] [-v (a|h|b)] [-c CFILE]"
+    print "Usage: %s [-h] [-d] [-l] [-g GFILE] [-r RFILE] [-n STEPS] [-s SEED] [-u (s|r|b)] [-i INT] [-m (q|s|d)] [-p PERIOD] [-v (a|h|b)] [-c CFILE]"
     print "\t-h        Print this message"
     print "\t-d        Operate in driven mode, serving as visualizer for another simulator"
     print "\t          In driven mode, only additional options -m, -p, -v, and -c are useful"
+    print "\t-l        Simulate with the C simulator in libgraphrat.so, rather than in Python"
     print "\t-g GFILE  Graph file"
     print "\t-r RFILE  Initial rat position file"
     print "\t-n STEPS  Number of simulation steps"
@@ -162,8 +164,11 @@ class DrivenSimulator(VizSimulator):
     def ratCount(self):
         return self.nrats
 
+    # Read one frame from driver.  Frames of the form "DELTA N R K"
+    # give only the K nodes whose counts changed, as lines "I C"
     def loadCounts(self):
         id = -1
+        delta = False
         for line in sys.stdin:
             if line[-1] == '\n':
                 line = line[:-1]
@@ -171,32 +176,38 @@ class DrivenSimulator(VizSimulator):
             if id == -1:
                 if len(tokens) >= 1 and tokens[0] == "DONE":
                     return tokens[0]
-                if len(tokens) < 1 or tokens[0] != "STEP":
+                if len(tokens) < 1 or tokens[0] not in ["STEP", "DELTA"]:
                     self.errorMsg("Invalid driver input.  First line contents '%s'" % line)
                     return "ERROR"
+                delta = tokens[0] == "DELTA"
                 try:
-                    ncount, self.nrats = map(int, tokens[1:])
+                    ncount, self.nrats = map(int, tokens[1:3])
                 except Exception as e:
                     self.errorMsg("Failed to receive parameter line from driver: %s.  Line contents '%s'" % (e, line))
                     return "ERROR"
                 if self.nodes == []:
                     self.nodes = [sim.Node(nid) for nid in xrange(ncount)]
-                else:
-                    for nid in xrange(ncount):
-                        self.nodes[nid].reset()
             elif len(tokens) == 1 and tokens[0] == "END":
                 break
-            elif len(tokens) == 1:
+            elif len(tokens) == 1 and not delta:
                 try:
                     count = int(tokens[0])
                 except Exception as e:
                     self.errorMsg("Failed to receive input for node %d from driver: %s.  Line contents '%s'" % (id, e, line))
                     return "ERROR"
                 self.nodes[id].ratCount = count
+            elif len(tokens) == 2 and delta:
+                try:
+                    nid, count = map(int, tokens)
+                    self.nodes[nid].ratCount = count
+                except Exception as e:
+                    self.errorMsg("Failed to receive change from driver: %s.  Line contents '%s'" % (e, line))
+                    return "ERROR"
             else:
-                self.errorMsg("Failed to receive input for node %d from driver: %s.  Line contents '%s'" % (id, e, line))
+                self.errorMsg("Failed to receive input for node %d from driver.  Line contents '%s'" % (id, line))
             id += 1
-        return "EMPTY" if id <= 1 else "OK"
+        # Frames without counts leave the display at its previous state
+        return "OK" if delta or id > 1 else "EMPTY"
                 
     def finishSim(self, tstart, count):
         self.finishDynamic()
@@ -239,6 +250,36 @@ class DrivenSimulator(VizSimulator):
             if code == "OK" and self.verb == OutputMode.step:
                 self.show(period = period)
                 
+# Visualize C simulator running in-process, through libgraphrat.so.
+# Displays its counts directly, without copying them into nodes
+class LibrarySimulator(DrivenSimulator):
+
+    def __init__(self, engine, verb = OutputMode.step, vizMode = viz.VizMode.heatmap):
+        DrivenSimulator.__init__(self, verb = verb, vizMode = vizMode)
+        self.engine = engine
+        self.nrats = engine.ratCount()
+        self.nodes = engine.counts()
+
+    def populationList(self):
+        return self.engine.counts()
+
+    def simulate(self, stepCount = 1, update = sim.UpdateMode.synchronous, period = 0.0, displayInterval = 1):
+        tstart = datetime.datetime.now()
+        if self.verb == OutputMode.step:
+            self.show(period = period)
+        taken = 0
+        while taken < stepCount:
+            count = min(displayInterval, stepCount - taken)
+            self.engine.step(count)
+            taken += count
+            self.time = self.engine.stepNumber()
+            if self.verb == OutputMode.step:
+                self.show(period = period)
+        self.finishSim(tstart, stepCount)
+
+    def finish(self, fname = ""):
+        DrivenSimulator.finish(self, fname)
+        self.engine.close()
 
 def run(name, args):
     gfname = ""
@@ -247,14 +288,16 @@ def run(name, args):
     seed = rutil.DEFAULTSEED
     period = 0.1
     drivenMode = False
+    useLibrary = False
     vm = OutputMode()
     verb = vm.step
     displayInterval = 1
     updateMode = sim.UpdateMode.batch
+    updateFlag = 'b'
     vizm = viz.VizMode()
     vizMode = vizm.heatmap
     captureFile = ""
-    optlist, args = getopt.getopt(args, "hdg:r:R:n:s:u:m:p:i:v:c:")
+    optlist, args = getopt.getopt(args, "hdlg:r:R:n:s:u:m:p:i:v:c:")
     for (opt, val) in optlist:
         if opt == '-h':
             usage(name)
@@ -272,6 +315,7 @@ def run(name, args):
                 print "Error.  Unrecognized update mode '%s'" % val
                 usage(name)
                 return
+            updateFlag = val
             if val == 's':
                 updateMode = sim.UpdateMode.synchronous
             elif val == 'r':
@@ -288,6 +332,8 @@ def run(name, args):
             period = float(val)
         if opt == '-d':
             drivenMode = True
+        if opt == '-l':
+            useLibrary = True
         if opt == '-i':
             displayInterval = int(val)
         if opt == '-v':
@@ -300,6 +346,20 @@ def run(name, args):
             captureFile = val
     if drivenMode:
         s = DrivenSimulator(verb = verb, vizMode = vizMode)
+    elif useLibrary:
+        if gfname == "" or irfname == "":
+            print "Error.  Need graph file and file of initial rat positions"
+            usage(name)
+            return
+        if verb == vm.drive:
+            print "Error.  Can't drive another program from libgraphrat.so"
+            return
+        try:
+            engine = graphrat.Engine(gfname, irfname, seed, updateFlag)
+        except Exception as e:
+            print "Error.  %s" % e
+            return
+        s = LibrarySimulator(engine, verb = verb, vizMode = vizMode)
     else:
         if gfname == "":
             print "Error.  Need graph file"
@@ -21,4 +21,8 @@ cd $PBS_O_WORKDIR
 # with the version of MPI running on the Latedays nodes
 ./benchmark.py -a o -f benchmark-XXXX.out
 
+# To run hybrid across several nodes, with one MPI process per 12-core
+# socket, change the allocation above to e.g. "nodes=2:ppn=24", and use
+# ./benchmark.py -a o -t 12 -p 48 -f benchmark-XXXX.out
+
 
@@ -0,0 +1,435 @@
+/*
+  Output stage.  Formats and writes simulation results on a separate
+  thread, so that the simulation can compute the next step while the
+  previous one is being written.  Snapshots of the rat counts go
+  through a bounded ring of buffers.  The simulation pushes frames and
+  the writer thread pops them without taking a lock.  The lock &
+  condition variable are only used when one side must sleep: the
+  simulation once the ring is full, and the writer once it is empty.
+
+  In delta format, frames with counts after the first list only the
+  nodes whose counts changed, as "DELTA N R K" followed by K lines
+  "I C" giving node I (numbered as in the graph file) and its new
+  count C, and then "END".  A full frame is sent every KEYFRAME_INTERVAL
+  frames with counts, and whenever it would be shorter than the delta.
+*/
+
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "crun.h"
+
+/* Frames with counts between full frames in delta format */
+#define KEYFRAME_INTERVAL 50
+
+/* Frame markers for binary output */
+#define STEP_MAGIC 0x50455453  /* "STEP" */
+#define DONE_MAGIC 0x454E4F44  /* "DONE" */
+
+typedef struct {
+    bool show_counts;  // Include counts for each node
+    bool last;         // Marks end of output.  Generates only "DONE"
+    int *count;        // Copy of rat_count.  Length = N
+} snapshot_t;
+
+struct writer {
+    graph_t *g;
+    int nrat;
+    output_t format;
+    /* When false, frames are written by the simulation thread */
+    bool threaded;
+    pthread_t thread;
+    /* Ring of snapshots.  Frame i goes in snapshot[i % nsnapshot] */
+    int nsnapshot;
+    snapshot_t *snapshot;
+    uint64_t head;  // Frames pushed.  Written only by simulation
+    uint64_t tail;  // Frames written.  Written only by writer thread
+    /* Number of stages sleeping on cond */
+    int nsleep;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* Formatted output for one frame */
+    char *buf;
+    size_t buf_len;
+    /* For delta format: Last counts sent, in graph file order */
+    int *sent_count;
+    /* Frames with counts until the next full frame */
+    int key_countdown;
+};
+
+/* Write all n bytes to stdout */
+static void write_all(const char *buf, size_t n) {
+    while (n > 0) {
+	ssize_t len = write(STDOUT_FILENO, buf, n);
+	if (len < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return;
+	}
+	buf += len;
+	n -= len;
+    }
+}
+
+/* Two-digit decimal representations of 0..99 */
+static const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+/* Format nonnegative integer followed by newline.  Returns end of formatted text */
+static inline char *format_count(char *p, unsigned v) {
+    char tmp[12];
+    char *t = tmp + sizeof(tmp);
+    while (v >= 100) {
+	unsigned r = v % 100;
+	v /= 100;
+	t -= 2;
+	t[0] = digit_pairs[2*r];
+	t[1] = digit_pairs[2*r+1];
+    }
+    if (v >= 10) {
+	t -= 2;
+	t[0] = digit_pairs[2*v];
+	t[1] = digit_pairs[2*v+1];
+    } else
+	*--t = '0' + v;
+    size_t len = tmp + sizeof(tmp) - t;
+    memcpy(p, t, len);
+    p[len] = '\n';
+    return p + len + 1;
+}
+
+/* Number of decimal digits in nonnegative integer */
+static inline int count_digits(unsigned v) {
+    int n = 1;
+    while (v >= 10) {
+	v /= 10;
+	n++;
+    }
+    return n;
+}
+
+/* Format and write frame with changed counts, or return false if a full frame is needed */
+static bool emit_delta(struct writer *w, snapshot_t *snap) {
+    int nnode = w->g->nnode;
+    int *node_rank = w->g->node_rank;
+    int *count = snap->count;
+    int *sent = w->sent_count;
+    int nid, nchange = 0;
+    size_t full_len = 0, delta_len = 0;
+
+    if (w->key_countdown == 0)
+	return false;
+    for (nid = 0; nid < nnode; nid++) {
+	int c = count[node_rank == NULL ? nid : node_rank[nid]];
+	int clen = count_digits(c) + 1;
+	full_len += clen;
+	if (c != sent[nid]) {
+	    delta_len += count_digits(nid) + 1 + clen;
+	    nchange++;
+	}
+    }
+    if (delta_len >= full_len)
+	return false;
+
+    char *p = w->buf;
+    p += sprintf(p, "DELTA %d %d %d\n", nnode, w->nrat, nchange);
+    for (nid = 0; nid < nnode && nchange > 0; nid++) {
+	int c = count[node_rank == NULL ? nid : node_rank[nid]];
+	if (c != sent[nid]) {
+	    /* Replace trailing newline of node number with space */
+	    p = format_count(p, nid);
+	    p[-1] = ' ';
+	    p = format_count(p, c);
+	    sent[nid] = c;
+	    nchange--;
+	}
+    }
+    memcpy(p, "END\n", 4);
+    p += 4;
+    write_all(w->buf, p - w->buf);
+    w->key_countdown--;
+    return true;
+}
+
+/* Format and write one frame */
+static void emit_frame(struct writer *w, snapshot_t *snap) {
+    graph_t *g = w->g;
+    int nnode = g->nnode;
+    int *node_rank = g->node_rank;
+    int *count = snap->count;
+    int nid;
+
+    if (snap->last) {
+	if (w->format == OUTPUT_BINARY) {
+	    int magic = DONE_MAGIC;
+	    write_all((char *) &magic, sizeof(int));
+	} else
+	    write_all("DONE\n", 5);
+	return;
+    }
+
+    if (w->format == OUTPUT_BINARY) {
+	int *p = (int *) w->buf;
+	*p++ = STEP_MAGIC;
+	*p++ = nnode;
+	*p++ = w->nrat;
+	*p++ = snap->show_counts;
+	if (snap->show_counts) {
+	    for (nid = 0; nid < nnode; nid++)
+		*p++ = count[node_rank == NULL ? nid : node_rank[nid]];
+	}
+	write_all(w->buf, (char *) p - w->buf);
+	return;
+    }
+
+    if (w->format == OUTPUT_DELTA && snap->show_counts) {
+	if (emit_delta(w, snap))
+	    return;
+	for (nid = 0; nid < nnode; nid++)
+	    w->sent_count[nid] = count[node_rank == NULL ? nid : node_rank[nid]];
+	w->key_countdown = KEYFRAME_INTERVAL - 1;
+    }
+
+    char *p = w->buf;
+    p += sprintf(p, "STEP %d %d\n", nnode, w->nrat);
+    if (snap->show_counts) {
+	if (node_rank != NULL) {
+	    for (nid = 0; nid < nnode; nid++)
+		p = format_count(p, count[node_rank[nid]]);
+	} else {
+	    for (nid = 0; nid < nnode; nid++)
+		p = format_count(p, count[nid]);
+	}
+    }
+    memcpy(p, "END\n", 4);
+    p += 4;
+    write_all(w->buf, p - w->buf);
+}
+
+/* Can't push when ring is full, and can't pop when it's empty */
+static bool ring_blocked(struct writer *w, bool push) {
+    uint64_t head = __atomic_load_n(&w->head, __ATOMIC_SEQ_CST);
+    uint64_t tail = __atomic_load_n(&w->tail, __ATOMIC_SEQ_CST);
+    return push ? head - tail == (uint64_t) w->nsnapshot : head == tail;
+}
+
+/* Sleep until ring has room to push, or a frame to pop */
+static void ring_wait(struct writer *w, bool push) {
+    if (!ring_blocked(w, push))
+	return;
+    pthread_mutex_lock(&w->lock);
+    __atomic_add_fetch(&w->nsleep, 1, __ATOMIC_SEQ_CST);
+    while (ring_blocked(w, push))
+	pthread_cond_wait(&w->cond, &w->lock);
+    __atomic_sub_fetch(&w->nsleep, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&w->lock);
+}
+
+/*
+  Advance head or tail, and wake the other stage if it's sleeping.
+  Either the sleeper sees the new index before it waits, or this sees
+  the sleeper
+ */
+static void ring_advance(struct writer *w, uint64_t *index) {
+    __atomic_add_fetch(index, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&w->nsleep, __ATOMIC_SEQ_CST) > 0) {
+	pthread_mutex_lock(&w->lock);
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+    }
+}
+
+static void *writer_thread(void *arg) {
+    struct writer *w = (struct writer *) arg;
+    bool last = false;
+    while (!last) {
+	ring_wait(w, false);
+	snapshot_t *snap = &w->snapshot[w->tail % w->nsnapshot];
+	emit_frame(w, snap);
+	last = snap->last;
+	ring_advance(w, &w->tail);
+    }
+    return NULL;
+}
+
+/* Start output stage for simulation.  Returns NULL on failure, and output is printed directly */
+struct writer *new_writer(state_t *s, output_t format) {
+    graph_t *g = s->g;
+    int i;
+    struct writer *w = malloc(sizeof(struct writer));
+    if (w == NULL) {
+	outmsg("Couldn't allocate output stage.  Printing text output directly\n");
+	return NULL;
+    }
+    w->g = g;
+    w->nrat = s->nrat;
+    w->format = format;
+    w->head = 0;
+    w->tail = 0;
+    w->nsleep = 0;
+    w->nsnapshot = s->output_depth > 0 ? s->output_depth : 1;
+    /* Room for header, counts of up to 10 digits, and trailer */
+    w->buf_len = 64 + (size_t) g->nnode * 11;
+    w->buf = malloc(w->buf_len);
+    bool ok = w->buf != NULL;
+    w->sent_count = NULL;
+    w->key_countdown = 0;
+    if (format == OUTPUT_DELTA) {
+	w->sent_count = int_alloc(g->nnode);
+	ok = ok && w->sent_count != NULL;
+    }
+    w->snapshot = calloc(w->nsnapshot, sizeof(snapshot_t));
+    ok = ok && w->snapshot != NULL;
+    for (i = 0; ok && i < w->nsnapshot; i++) {
+	w->snapshot[i].count = int_alloc(g->nnode);
+	ok = w->snapshot[i].count != NULL;
+    }
+    if (!ok) {
+	outmsg("Couldn't allocate output buffers.  Printing text output directly\n");
+	for (i = 0; w->snapshot != NULL && i < w->nsnapshot; i++)
+	    free(w->snapshot[i].count);
+	free(w->snapshot);
+	free(w->sent_count);
+	free(w->buf);
+	free(w);
+	return NULL;
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+
+    /* Anything already printed must come first */
+    fflush(stdout);
+    w->threaded = pthread_create(&w->thread, NULL, writer_thread, w) == 0;
+    if (!w->threaded)
+	outmsg("WARNING: Couldn't start output thread.  Writing output directly\n");
+    return w;
+}
+
+/* Queue frame.  Waits if all snapshot buffers are in use */
+static void queue_frame(struct writer *w, int *rat_count, bool show_counts, bool last) {
+    if (w->threaded)
+	ring_wait(w, true);
+    snapshot_t *snap = &w->snapshot[w->head % w->nsnapshot];
+    snap->show_counts = show_counts;
+    snap->last = last;
+    if (show_counts && !last)
+	memcpy(snap->count, rat_count, w->g->nnode * sizeof(int));
+    if (!w->threaded) {
+	emit_frame(w, snap);
+	return;
+    }
+    ring_advance(w, &w->head);
+}
+
+/* Queue snapshot of current state for output */
+void write_step(state_t *s, bool show_counts) {
+    queue_frame(s->writer, s->rat_count, show_counts, false);
+}
+
+/* Mix (index, value) pair, using the splitmix64 finalizer */
+static inline uint64_t mix_pair(uint32_t index, uint32_t value) {
+    uint64_t z = (((uint64_t) index << 32) | value) + 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* Hash of counts for nodes [lo, hi) */
+static uint64_t hash_counts(state_t *s, int lo, int hi) {
+    int *node_order = s->g->node_order;
+    uint64_t h = 0;
+    int nid;
+#if OMP
+#pragma omp parallel for schedule(static) reduction(+:h) if (s->nthread > 1) num_threads(s->nthread)
+#endif
+    for (nid = lo; nid < hi; nid++)
+	h += mix_pair(node_order == NULL ? nid : node_order[nid], s->rat_count[nid]);
+    return h;
+}
+
+/* Hash of positions for n rats listed in rat, or for all rats when rat is NULL */
+static uint64_t hash_positions(state_t *s, int *rat, int n) {
+    int *node_order = s->g->node_order;
+    uint64_t h = 0;
+    int i;
+#if OMP
+#pragma omp parallel for schedule(static) reduction(+:h) if (s->nthread > 1) num_threads(s->nthread)
+#endif
+    for (i = 0; i < n; i++) {
+	int ri = rat == NULL ? i : rat[i];
+	int nid = s->rat_position[ri];
+	h += mix_pair(ri, node_order == NULL ? nid : node_order[nid]);
+    }
+    return h;
+}
+
+void state_hash(state_t *s, uint64_t h[2]) {
+    h[0] = hash_counts(s, 0, s->g->nnode);
+    h[1] = hash_positions(s, NULL, s->nrat);
+}
+
+void show_hash(state_t *s) {
+    bool mpi_master = s->process_id == 0;
+    /* Parts of hashes of counts & positions computed here */
+    uint64_t h[2] = { 0, 0 };
+    bool partitioned = false;
+
+#if MPI
+    if (s->domain) {
+	domain_t *d = s->domain;
+	h[0] = hash_counts(s, d->node_lo, d->node_hi);
+	h[1] = hash_positions(s, d->local_rat, d->nlocal);
+	partitioned = true;
+    } else if (s->ratpart) {
+	/* Every process has all of the counts */
+	if (mpi_master)
+	    h[0] = hash_counts(s, 0, s->g->nnode);
+	h[1] = hash_positions(s, s->ratpart->own_rat, s->ratpart->nown);
+	partitioned = true;
+    }
+#endif
+    if (!partitioned)
+	state_hash(s, h);
+#if MPI
+    if (partitioned) {
+	if (mpi_master)
+	    MPI_Reduce(MPI_IN_PLACE, h, 2, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+	else
+	    MPI_Reduce(h, NULL, 2, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+    }
+#endif
+    if (!mpi_master)
+	return;
+    if (s->output_format == OUTPUT_HASH_RATS)
+	printf("HASH %d %016lx %016lx\n", s->step, (unsigned long) h[0], (unsigned long) h[1]);
+    else
+	printf("HASH %d %016lx\n", s->step, (unsigned long) h[0]);
+}
+
+/* Generate done message, then wait for output stage to finish */
+void finish_writer(state_t *s) {
+    struct writer *w = s->writer;
+    int i;
+    queue_frame(w, NULL, false, true);
+    if (w->threaded)
+	pthread_join(w->thread, NULL);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->cond);
+    for (i = 0; i < w->nsnapshot; i++)
+	free(w->snapshot[i].count);
+    free(w->snapshot);
+    free(w->sent_count);
+    free(w->buf);
+    free(w);
+    s->writer = NULL;
+}
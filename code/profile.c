@@ -0,0 +1,75 @@
+/* Per-phase timing of the simulation.  Only compiled in when PROFILE is enabled */
+
+#include "crun.h"
+
+#if PROFILE
+
+static char *phase_names[NPHASE] = { "census", "gsums", "move", "commit", "output", "comm" };
+
+/* Allocate zeroed timings for each thread.  Returns NULL on failure */
+profile_t *new_profile(int nthread) {
+    profile_t *p = aligned_alloc(sizeof(profile_t), nthread * sizeof(profile_t));
+    if (p == NULL) {
+	outmsg("Couldn't allocate storage for phase timings\n");
+	return NULL;
+    }
+    memset(p, 0, nthread * sizeof(profile_t));
+    return p;
+}
+
+/* Collect timings from all processes and write JSON report at the master */
+void write_profile(state_t *s, char *fname) {
+    int nthread = s->nthread;
+    int nprocess = s->nprocess;
+    /* Ticks & calls for each phase of each thread, process by process */
+    int nval = nthread * 2 * NPHASE;
+    uint64_t *vals = calloc((size_t) nprocess * nval, sizeof(uint64_t));
+    int p, t, ph;
+
+    if (vals == NULL) {
+	outmsg("Couldn't allocate space for phase timings\n");
+	return;
+    }
+    for (t = 0; t < nthread && s->profile != NULL; t++) {
+	for (ph = 0; ph < NPHASE; ph++) {
+	    vals[(2*t) * NPHASE + ph] = s->profile[t].ticks[ph];
+	    vals[(2*t+1) * NPHASE + ph] = s->profile[t].calls[ph];
+	}
+    }
+#if MPI
+    if (s->process_id == 0)
+	MPI_Gather(MPI_IN_PLACE, nval, MPI_UINT64_T, vals, nval, MPI_UINT64_T, 0, MPI_COMM_WORLD);
+    else
+	MPI_Gather(vals, nval, MPI_UINT64_T, NULL, nval, MPI_UINT64_T, 0, MPI_COMM_WORLD);
+#endif
+    if (s->process_id != 0) {
+	free(vals);
+	return;
+    }
+
+    FILE *outfile = fopen(fname, "w");
+    if (outfile == NULL) {
+	outmsg("Couldn't open profile file %s\n", fname);
+	free(vals);
+	return;
+    }
+    double spt = secondsPerTick();
+    fprintf(outfile, "{\n  \"processes\": %d,\n  \"threads\": %d,\n  \"seconds_per_tick\": %.6g,\n", nprocess, nthread, spt);
+    fprintf(outfile, "  \"timings\": [");
+    for (p = 0; p < nprocess; p++) {
+	for (t = 0; t < nthread; t++) {
+	    uint64_t *tv = vals + (size_t) p * nval + 2 * t * NPHASE;
+	    fprintf(outfile, "%s\n    {\"process\": %d, \"thread\": %d", p + t == 0 ? "" : ",", p, t);
+	    for (ph = 0; ph < NPHASE; ph++)
+		fprintf(outfile, ", \"%s\": {\"seconds\": %.6f, \"calls\": %lu}",
+			phase_names[ph], tv[ph] * spt, (unsigned long) tv[NPHASE + ph]);
+	    fprintf(outfile, "}");
+	}
+    }
+    fprintf(outfile, "\n  ]\n}\n");
+    fclose(outfile);
+    outmsg("Wrote phase timings to %s\n", fname);
+    free(vals);
+}
+
+#endif /* PROFILE */
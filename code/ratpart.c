@@ -0,0 +1,144 @@
+/* Rat partitioning of the simulation for crun-mpi */
+
+#include "crun.h"
+
+/* Find slice [lo, hi) of batch moved by this process */
+void slice_range(state_t *s, int bstart, int bcount, int *lo, int *hi) {
+    int p = s->process_id;
+    int nprocess = s->nprocess;
+    *lo = bstart + (int) (((long) bcount * p) / nprocess);
+    *hi = bstart + (int) (((long) bcount * (p+1)) / nprocess);
+}
+
+/* Assign slices of each batch to processes.  Aborts all processes on failure */
+ratpart_t *new_ratpart(state_t *s, int batch_size) {
+    int nnode = s->g->nnode;
+    int nprocess = s->nprocess;
+    int b, ri;
+
+    /* The other processes would wait forever in collective operations */
+    ratpart_t *rp = calloc(1, sizeof(ratpart_t));
+    if (rp == NULL) {
+        outmsg("Couldn't allocate storage for rat partition\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    /* Every rat in a slice could change the counts for two nodes */
+    int slice_max = (batch_size + nprocess - 1) / nprocess;
+    rp->pack_len = 1 + 4 * slice_max;
+    rp->delta = int_alloc(nnode);
+    rp->total_delta = int_alloc(nnode);
+    rp->own_rat = int_alloc(s->nrat);
+    /* Packed changes are only used when they are smaller than the counts */
+    if ((size_t) nprocess * rp->pack_len < nnode) {
+        rp->pack = int_alloc(rp->pack_len);
+        rp->all_pack = int_alloc((size_t) nprocess * rp->pack_len);
+    }
+    if (rp->delta == NULL || rp->total_delta == NULL || rp->own_rat == NULL ||
+        ((size_t) nprocess * rp->pack_len < nnode && (rp->pack == NULL || rp->all_pack == NULL))) {
+        outmsg("Couldn't allocate space for %d rats in rat partition\n", s->nrat);
+        free_ratpart(rp);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    rp->nown = 0;
+    for (b = 0; b < s->nrat; b += batch_size) {
+        int rest = s->nrat - b;
+        int lo, hi;
+        slice_range(s, b, rest < batch_size ? rest : batch_size, &lo, &hi);
+        for (ri = lo; ri < hi; ri++)
+            rp->own_rat[rp->nown++] = ri;
+    }
+    return rp;
+}
+
+void free_ratpart(ratpart_t *rp) {
+    free(rp->delta);
+    free(rp->total_delta);
+    free(rp->own_rat);
+    free(rp->pack);
+    free(rp->all_pack);
+    free(rp);
+}
+
+/* Send packed (nid, delta) pairs for changed nodes to all processes */
+static void exchange_packed(state_t *s, int lo, int hi, int len) {
+    ratpart_t *rp = s->ratpart;
+    int *delta = rp->delta;
+    int *pack = rp->pack;
+    int *rat_count = s->rat_count;
+    int n = 0;
+    int ri, p, i;
+
+    for (ri = lo; ri < hi; ri++) {
+        int ends[2] = { s->rat_position[ri], s->next_rat_position[ri] };
+        for (i = 0; i < 2; i++) {
+            int nid = ends[i];
+            if (delta[nid] != 0) {
+                pack[1+2*n] = nid;
+                pack[2+2*n] = delta[nid];
+                delta[nid] = 0;
+                n++;
+            }
+        }
+    }
+    pack[0] = n;
+
+    MPI_Allgather(pack, len, MPI_INT, rp->all_pack, len, MPI_INT, MPI_COMM_WORLD);
+
+    for (p = 0; p < s->nprocess; p++) {
+        int *q = rp->all_pack + (size_t) p * len;
+        for (i = 0; i < q[0]; i++) {
+            int nid = q[1+2*i];
+            rat_count[nid] += q[2+2*i];
+            mark_dirty(s, nid);
+        }
+    }
+}
+
+/* Sum changes for all nodes across processes */
+static void exchange_dense(state_t *s) {
+    ratpart_t *rp = s->ratpart;
+    int nnode = s->g->nnode;
+    int *total_delta = rp->total_delta;
+    int *rat_count = s->rat_count;
+    int nid;
+
+    MPI_Allreduce(rp->delta, total_delta, nnode, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+    memset(rp->delta, 0, nnode * sizeof(int));
+
+    for (nid = 0; nid < nnode; nid++) {
+        if (total_delta[nid] != 0) {
+            rat_count[nid] += total_delta[nid];
+            mark_dirty(s, nid);
+        }
+    }
+}
+
+/*
+  Combine the count changes from every process's slice of the batch,
+  and mark the changed nodes as dirty.  Uses whichever of the packed
+  changes or the full vector of counts is smaller
+ */
+void exchange_deltas(state_t *s, int bstart, int bcount) {
+    ratpart_t *rp = s->ratpart;
+    int nprocess = s->nprocess;
+    int *delta = rp->delta;
+    int lo, hi, ri;
+
+    slice_range(s, bstart, bcount, &lo, &hi);
+    for (ri = lo; ri < hi; ri++) {
+        int onid = s->rat_position[ri];
+        int nnid = s->next_rat_position[ri];
+        if (onid != nnid) {
+            delta[onid]--;
+            delta[nnid]++;
+        }
+    }
+
+    int slice_max = (bcount + nprocess - 1) / nprocess;
+    int len = 1 + 4 * slice_max;
+    if (rp->pack != NULL && (size_t) nprocess * len < s->g->nnode)
+        exchange_packed(s, lo, hi, len);
+    else
+        exchange_dense(s);
+}
@@ -9,14 +9,21 @@ import os
 import os.path
 import getopt
 
+import rutil
+import graphrat
+
 def usage(fname):
     ustring = "Usage: %s [-h] [-c]" % fname
-    ustring += " [-p PCS]"
+    ustring += " [-p PCS] [-t THD] [-H] [-l]"
     print ustring
     print "    -h       Print this message"
     print "    -c       Clear expected result cache"
     print "    -p PCS   Specify number of MPI processes"
     print "       If > 1, will run crun-mpi.  Else will run crun"
+    print "    -t THD   Specify number of threads"
+    print "       If > 1, will run crun-omp"
+    print "    -H       Compare only per-step hashes of the rat counts"
+    print "    -l       Run simulator in-process through libgraphrat.so"
     print     "-a       Run ALL tests, including for big graphs"
     sys.exit(0)
 
@@ -74,14 +81,17 @@ extraRegressionList = [
 def regressionName(params, standard = True):
     return ("ref" if standard else "tst") +  "-%.3d-%s-%s-%.3d-%.3d-%s-%.2d.txt" % params
 
-def regressionCommand(params, standard = True, processCount = 1):
+def dataFiles(params):
     graphSize, graphType, ratType, ratLoad, stepCount, updateFlag, seed = params
-
     sizeName = str(graphSize)
-
     graphFileName = dataDir + "g-" + graphType + sizeName + ".gph"
-
     ratFileName = dataDir + "r-" + sizeName + '-' + ratType + str(ratLoad) + ".rats"
+    return (graphFileName, ratFileName)
+
+def regressionCommand(params, standard = True, processCount = 1, threadCount = 1):
+    graphSize, graphType, ratType, ratLoad, stepCount, updateFlag, seed = params
+
+    graphFileName, ratFileName = dataFiles(params)
 
     prog = ''
     prelist = []
@@ -91,6 +101,8 @@ def regressionCommand(params, standard = True, processCount = 1):
     elif processCount > 1:
         prog = mpiTestProg
         prelist += ["mpirun", "-np", str(processCount)]
+    elif threadCount > 1:
+        prog = ompTestProg
     else:
         prog = testProg
 
@@ -98,12 +110,14 @@ def regressionCommand(params, standard = True, processCount = 1):
 
     if standard:
         cmd += ["-m", "d"]
+    elif threadCount > 1:
+        cmd += ["-t", str(threadCount)]
     return cmd
 
 
 
-def runSim(params, standard = True, processCount = 1, xflags = []):
-    cmd = regressionCommand(params, standard, processCount) + xflags
+def runSim(params, standard = True, processCount = 1, threadCount = 1, xflags = []):
+    cmd = regressionCommand(params, standard, processCount, threadCount) + xflags
     cmdLine = " ".join(cmd)
 
     pname = cacheDir + regressionName(params, standard)
@@ -164,23 +178,82 @@ def checkFiles(refPath, testPath):
     if badLines > 0:
         sys.stderr.write("%d total mismatches.  Files %s, %s\n" % (badLines, refPath, testPath))
     return badLines == 0
+
+# Compare hashes printed by test simulator to those of the reference counts
+def checkHashes(refPath, testPath):
+    try:
+        rf = open(refPath, 'r')
+    except:
+        sys.stderr.write("Couldn't open reference file '%s'\n" % refPath);
+        return False
+    try:
+        tf = open(testPath, 'r')
+    except:
+        sys.stderr.write("Couldn't open test file '%s'\n" % testPath);
+        return False
+    refHashes = rutil.readCountHashes(rf)
+    testHashes = rutil.readHashLines(tf)
+    rf.close()
+    tf.close()
+    step = rutil.firstHashMismatch(refHashes, testHashes)
+    if step is not None:
+        sys.stderr.write("Mismatch at step %d.  Files %s, %s\n" % (step, refPath, testPath))
+    return step is None
+
+# Step simulator library, comparing its counts to each frame of reference output
+def checkLibrary(params, refPath, threadCount = 1):
+    graphSize, graphType, ratType, ratLoad, stepCount, updateFlag, seed = params
+    graphFileName, ratFileName = dataFiles(params)
+    try:
+        rf = open(refPath, 'r')
+    except:
+        sys.stderr.write("Couldn't open reference file '%s'\n" % refPath);
+        return False
+    try:
+        sys.stderr.write("Simulating %s with %s\n" % (regressionName(params, standard = False), graphrat.libName))
+        engine = graphrat.Engine(graphFileName, ratFileName, seed, updateFlag, threadCount)
+    except Exception as e:
+        sys.stderr.write("Couldn't start simulator library: %s\n" % e)
+        rf.close()
+        return False
+    badSteps = 0
+    for (step, refCounts) in rutil.readFrames(rf):
+        engine.step(step - engine.stepNumber())
+        if refCounts is None:
+            continue
+        counts = list(engine.counts())
+        if counts != refCounts:
+            badSteps += 1
+            if badSteps <= mismatchLimit:
+                nid = [i for i in range(len(counts)) if i >= len(refCounts) or counts[i] != refCounts[i]][0]
+                sys.stderr.write("Mismatch at step %d, node %d.  File %s\n" % (step, nid, refPath))
+    engine.close()
+    rf.close()
+    if badSteps > 0:
+        sys.stderr.write("%d total mismatched steps.  File %s\n" % (badSteps, refPath))
+    return badSteps == 0
             
-def regress(params, processCount, xflags = []):
+def regress(params, processCount, threadCount = 1, xflags = [], hashCheck = False, useLibrary = False):
     refPath = cacheDir + regressionName(params, standard = True)
     if not os.path.exists(refPath):
         if not runSim(params, standard = True):
             sys.stderr.write("Failed to run simulation with reference simulator\n")
             return False
 
-    if not runSim(params, standard = False, processCount = processCount, xflags = xflags):
+    if useLibrary:
+        return checkLibrary(params, refPath, threadCount)
+
+    if not runSim(params, standard = False, processCount = processCount, threadCount = threadCount, xflags = xflags):
         sys.stderr.write("Failed to run simulation with test simulator\n")
         return False
         
     testPath = cacheDir + regressionName(params, standard = False)
 
+    if hashCheck:
+        return checkHashes(refPath, testPath)
     return checkFiles(refPath, testPath)
 
-def run(flushCache, processCount, xflags, doAll):
+def run(flushCache, processCount, threadCount, xflags, doAll, hashCheck, useLibrary):
     if flushCache and os.path.exists(cacheDir):
         try:
             simProcess = subprocess.Popen(["rm", "-rf", cacheDir])
@@ -198,7 +271,7 @@ def run(flushCache, processCount, xflags, doAll):
     rlist = regressionList + (extraRegressionList if doAll else [])
     for p in rlist:
         allCount += 1
-        if regress(p, processCount, xflags):
+        if regress(p, processCount, threadCount, xflags, hashCheck, useLibrary):
             sys.stderr.write("Regression %s passed\n" % regressionName(p, standard = False))
             goodCount += 1
     totalCount = len(rlist)
@@ -209,9 +282,12 @@ def run(flushCache, processCount, xflags, doAll):
 if __name__ == "__main__":
     flushCache = False
     processCount = 1
+    threadCount = 1
     xflags = []
     doAll = False
-    optstring = "hcp:a"
+    hashCheck = False
+    useLibrary = False
+    optstring = "hcp:t:aHl"
     optlist, args = getopt.getopt(sys.argv[1:], optstring)
     for (opt, val) in optlist:
         if opt == '-h':
@@ -220,6 +296,13 @@ if __name__ == "__main__":
             flushCache = True
         elif opt == '-p':
             processCount = int(val)
+        elif opt == '-t':
+            threadCount = int(val)
         elif opt == '-a':
             doAll = True
-    run(flushCache, processCount, xflags, doAll)
+        elif opt == '-H':
+            hashCheck = True
+            xflags = ["-f", "h"]
+        elif opt == '-l':
+            useLibrary = True
+    run(flushCache, processCount, threadCount, xflags, doAll, hashCheck, useLibrary)
@@ -5,6 +5,13 @@
 
 #include "rutil.h"
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define RUTIL_SIMD 1
+#else
+#define RUTIL_SIMD 0
+#endif
+
 /* Standard parameters */
 #define GROUPSIZE 2147483647
 #define MVAL  48271
@@ -12,10 +19,21 @@
 #define INITSEED  418
 
 
+/*
+  Compute v mod GROUPSIZE for v < 2^62.  Since GROUPSIZE = 2^31-1,
+  2^31 = 1 (mod GROUPSIZE), and so the high bits can be folded onto
+  the low ones, rather than dividing.
+ */
+static inline random_t reduce(uint64_t v) {
+    v = (v & GROUPSIZE) + (v >> 31);
+    v = (v & GROUPSIZE) + (v >> 31);
+    return (random_t) (v >= GROUPSIZE ? v - GROUPSIZE : v);
+}
+
 static inline random_t rnext(random_t *seedp, random_t x) {
     uint64_t s = (uint64_t) *seedp;
     uint64_t xlong = (uint64_t) x;
-    random_t val = ((xlong+1) * VVAL + s * MVAL) % GROUPSIZE;
+    random_t val = reduce((xlong+1) * VVAL + s * MVAL);
     *seedp = (random_t) val;
     return val;
 }
@@ -34,6 +52,89 @@ double next_random_float(random_t *seedp, double upperlimit) {
     return ((double) val / (double) GROUPSIZE) * upperlimit;
 }
 
+/*
+  Advance seed n steps, as n calls to next_random_float would.  Each
+  step applies the map s -> MVAL*s + VVAL, and so repeated squaring of
+  the map takes O(log n) time
+ */
+void skip_random(random_t *seedp, uint64_t n) {
+    uint64_t a = MVAL;
+    uint64_t c = VVAL;
+    uint64_t s = *seedp;
+    while (n > 0) {
+	if (n & 1)
+	    s = reduce(a * s + c);
+	c = reduce(a * c + c);
+	a = reduce(a * a);
+	n >>= 1;
+    }
+    *seedp = (random_t) s;
+}
+
+static void next_random_floats_scalar(random_t *seeds, double *vals, size_t n) {
+    size_t i;
+    for (i = 0; i < n; i++)
+	vals[i] = next_random_float(&seeds[i], 1.0);
+}
+
+#if RUTIL_SIMD
+/* Products are below 2^48, so a single fold leaves a value below 2*GROUPSIZE */
+__attribute__((target("avx2")))
+static void next_random_floats_avx2(random_t *seeds, double *vals, size_t n) {
+    const __m256i mval = _mm256_set1_epi64x(MVAL);
+    const __m256i vval = _mm256_set1_epi64x(VVAL);
+    const __m256i group = _mm256_set1_epi64x(GROUPSIZE);
+    const __m256i gmax = _mm256_set1_epi64x(GROUPSIZE - 1);
+    const __m256i evens = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    const __m256d gdouble = _mm256_set1_pd((double) GROUPSIZE);
+    size_t i;
+    for (i = 0; i + 4 <= n; i += 4) {
+	__m256i s = _mm256_cvtepu32_epi64(_mm_loadu_si128((__m128i *) &seeds[i]));
+	__m256i v = _mm256_add_epi64(_mm256_mul_epu32(s, mval), vval);
+	v = _mm256_add_epi64(_mm256_and_si256(v, group), _mm256_srli_epi64(v, 31));
+	v = _mm256_sub_epi64(v, _mm256_and_si256(_mm256_cmpgt_epi64(v, gmax), group));
+	__m128i v32 = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(v, evens));
+	_mm_storeu_si128((__m128i *) &seeds[i], v32);
+	_mm256_storeu_pd(&vals[i], _mm256_div_pd(_mm256_cvtepi32_pd(v32), gdouble));
+    }
+    next_random_floats_scalar(seeds + i, vals + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+static void next_random_floats_avx512(random_t *seeds, double *vals, size_t n) {
+    const __m512i mval = _mm512_set1_epi64(MVAL);
+    const __m512i vval = _mm512_set1_epi64(VVAL);
+    const __m512i group = _mm512_set1_epi64(GROUPSIZE);
+    const __m512d gdouble = _mm512_set1_pd((double) GROUPSIZE);
+    size_t i;
+    for (i = 0; i + 8 <= n; i += 8) {
+	__m512i s = _mm512_cvtepu32_epi64(_mm256_loadu_si256((__m256i *) &seeds[i]));
+	__m512i v = _mm512_add_epi64(_mm512_mul_epu32(s, mval), vval);
+	v = _mm512_add_epi64(_mm512_and_si512(v, group), _mm512_srli_epi64(v, 31));
+	v = _mm512_mask_sub_epi64(v, _mm512_cmpge_epu64_mask(v, group), v, group);
+	__m256i v32 = _mm512_cvtepi64_epi32(v);
+	_mm256_storeu_si256((__m256i *) &seeds[i], v32);
+	_mm512_storeu_pd(&vals[i], _mm512_div_pd(_mm512_cvtepi32_pd(v32), gdouble));
+    }
+    next_random_floats_scalar(seeds + i, vals + i, n - i);
+}
+#endif
+
+/* Generate doubles in range [0.0, 1.0) for n consecutive seeds */
+void next_random_floats(random_t *seeds, double *vals, size_t n) {
+#if RUTIL_SIMD
+    if (__builtin_cpu_supports("avx512f")) {
+	next_random_floats_avx512(seeds, vals, n);
+	return;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+	next_random_floats_avx2(seeds, vals, n);
+	return;
+    }
+#endif
+    next_random_floats_scalar(seeds, vals, n);
+}
+
 /* Parameters for computing weights that guide next-move selection */
 #define COEFF 0.5
 #define OPTVAL 1.5
@@ -24,6 +24,17 @@ void reseed(random_t *seedp, random_t seed_list[], size_t len);
 /* Generate double in range [0.0, upperlimit) */
 double next_random_float(random_t *seedp, double upperlimit);
 
+/* Advance seed as if next_random_float were called n times */
+void skip_random(random_t *seedp, uint64_t n);
+
+/*
+  Generate doubles in range [0.0, 1.0) for n consecutive seeds,
+  advancing each seed once.  Same as calling next_random_float with
+  upperlimit 1.0 on each seed, but uses SIMD instructions when the
+  processor supports them.
+ */
+void next_random_floats(random_t *seeds, double *vals, size_t n);
+
 /* Compute weight function */
 double mweight(double val);
 
@@ -130,3 +130,67 @@ def mweight(val):
 def chooseMove(rng, vals):
     weights = [mweight(l) for l in vals]
     return rng.weightedIndex(weights)
+
+# Hashes of simulator state, as printed by crun with output format h or H.
+# Each value is mixed with its index, and the mixes are summed mod 2^64
+MASK64 = (1 << 64) - 1
+
+def mixPair(index, value):
+    z = (((index << 32) | value) + 0x9e3779b97f4a7c15) & MASK64
+    z = ((z ^ (z >> 30)) * 0xbf58476d1ce4e5b9) & MASK64
+    z = ((z ^ (z >> 27)) * 0x94d049bb133111eb) & MASK64
+    return z ^ (z >> 31)
+
+def stateHash(values):
+    h = 0
+    for idx in range(len(values)):
+        h += mixPair(idx, values[idx])
+    return h & MASK64
+
+# Read text simulator output, generating (step, counts) for each frame.
+# Counts is None for frames without them
+def readFrames(f):
+    step = 0
+    counts = None
+    for line in f:
+        tokens = line.split()
+        if len(tokens) == 0:
+            continue
+        if tokens[0] == "STEP":
+            counts = []
+        elif tokens[0] == "END":
+            yield (step, counts if counts else None)
+            counts = None
+            step += 1
+        elif tokens[0] == "DONE":
+            break
+        elif counts is not None:
+            counts.append(int(tokens[0]))
+
+# Read text simulator output and return dictionary mapping step number
+# to hash of rat counts, for those steps that have counts
+def readCountHashes(f):
+    hashes = {}
+    for (step, counts) in readFrames(f):
+        if counts is not None:
+            hashes[step] = stateHash(counts)
+    return hashes
+
+# Read hash output and return dictionary mapping step number to hash of rat counts
+def readHashLines(f):
+    hashes = {}
+    for line in f:
+        tokens = line.split()
+        if len(tokens) >= 3 and tokens[0] == "HASH":
+            hashes[int(tokens[1])] = int(tokens[2], 16)
+        elif len(tokens) == 1 and tokens[0] == "DONE":
+            break
+    return hashes
+
+# Compare dictionaries of hashes.  Return first step at which they
+# differ, or None if they agree on every step in the reference
+def firstHashMismatch(refHashes, testHashes):
+    for step in sorted(refHashes.keys()):
+        if step not in testHashes or testHashes[step] != refHashes[step]:
+            return step
+    return None
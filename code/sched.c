@@ -0,0 +1,129 @@
+/*
+  Work-stealing scheduler for the threaded loops.  A loop's index
+  range is split into chunks of about equal weight.  Each thread starts
+  with a contiguous run of chunks in its own deque, takes chunks from
+  the front, and once it runs out, steals chunks from the back of the
+  other threads' deques.  Every index is processed exactly once, and
+  the loops write their results by index, so the results don't depend
+  on which thread handled which chunk.
+*/
+
+#include "crun.h"
+
+/* Pack & unpack deque as 32-bit head and tail chunk indices */
+#define DEQUE(head, tail) (((uint64_t) (head) << 32) | (uint32_t) (tail))
+#define DEQUE_HEAD(d) ((int) ((d) >> 32))
+#define DEQUE_TAIL(d) ((int) (uint32_t) (d))
+
+/* Allocate scheduler for nthread threads.  Returns NULL on failure */
+sched_t *new_sched(int nthread) {
+    sched_t *sc = malloc(sizeof(sched_t));
+    if (sc == NULL)
+	return NULL;
+    sc->nthread = nthread;
+    sc->nchunk = 0;
+    sc->chunk_start = int_alloc((size_t) nthread * STEAL_CHUNKS + 1);
+    sc->deque = aligned_alloc(sizeof(deque_t), nthread * sizeof(deque_t));
+    if (sc->chunk_start == NULL || sc->deque == NULL) {
+	free(sc->chunk_start);
+	free(sc->deque);
+	free(sc);
+	return NULL;
+    }
+    return sc;
+}
+
+void free_sched(sched_t *sc) {
+    free(sc->chunk_start);
+    free(sc->deque);
+    free(sc);
+}
+
+/* Give each thread an equal run of chunks */
+static void fill_deques(sched_t *sc) {
+    int t;
+    for (t = 0; t < sc->nthread; t++) {
+	int head = (int) (((long) sc->nchunk * t) / sc->nthread);
+	int tail = (int) (((long) sc->nchunk * (t+1)) / sc->nthread);
+	sc->deque[t].range = DEQUE(head, tail);
+    }
+}
+
+/*
+  Split indices [lo, hi) into chunks.  When weight_start is not NULL,
+  index i has weight weight_start[i+1] - weight_start[i], and chunks
+  have about equal total weight.  Otherwise all indices have equal weight.
+  Must be called outside of parallel regions
+ */
+void sched_split(sched_t *sc, int lo, int hi, int *weight_start) {
+    int maxchunk = sc->nthread * STEAL_CHUNKS;
+    int n = hi - lo;
+    int c;
+    int nchunk = n < maxchunk ? n : maxchunk;
+
+    sc->chunk_start[0] = lo;
+    if (weight_start == NULL) {
+	for (c = 1; c <= nchunk; c++)
+	    sc->chunk_start[c] = lo + (int) (((long) n * c) / nchunk);
+    } else {
+	long wlo = weight_start[lo];
+	long wtotal = weight_start[hi] - wlo;
+	int i = lo;
+	for (c = 1; c < nchunk; c++) {
+	    long target = wlo + (wtotal * c) / nchunk;
+	    /* Find first index at or above target weight, leaving every chunk nonempty */
+	    int left = sc->chunk_start[c-1] + 1;
+	    int right = hi - (nchunk - c);
+	    if (i < left)
+		i = left;
+	    while (i < right && weight_start[i] < target)
+		i++;
+	    sc->chunk_start[c] = i;
+	}
+	sc->chunk_start[nchunk] = hi;
+    }
+    sc->nchunk = nchunk;
+    fill_deques(sc);
+}
+
+/* Take chunk from front of own deque */
+static bool take_own(deque_t *dq, int *chunk) {
+    uint64_t d = __atomic_load_n(&dq->range, __ATOMIC_ACQUIRE);
+    while (DEQUE_HEAD(d) < DEQUE_TAIL(d)) {
+	uint64_t nd = DEQUE(DEQUE_HEAD(d) + 1, DEQUE_TAIL(d));
+	if (__atomic_compare_exchange_n(&dq->range, &d, nd, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+	    *chunk = DEQUE_HEAD(d);
+	    return true;
+	}
+    }
+    return false;
+}
+
+/* Take chunk from back of another thread's deque */
+static bool steal(deque_t *dq, int *chunk) {
+    uint64_t d = __atomic_load_n(&dq->range, __ATOMIC_ACQUIRE);
+    while (DEQUE_HEAD(d) < DEQUE_TAIL(d)) {
+	uint64_t nd = DEQUE(DEQUE_HEAD(d), DEQUE_TAIL(d) - 1);
+	if (__atomic_compare_exchange_n(&dq->range, &d, nd, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+	    *chunk = DEQUE_TAIL(d) - 1;
+	    return true;
+	}
+    }
+    return false;
+}
+
+/*
+  Get next range [*lo, *hi) for thread tid to process.  Returns false
+  once no work remains anywhere
+ */
+bool sched_next(sched_t *sc, int tid, int *lo, int *hi) {
+    int chunk, i;
+    bool found = take_own(&sc->deque[tid], &chunk);
+    for (i = 1; !found && i < sc->nthread; i++)
+	found = steal(&sc->deque[(tid + i) % sc->nthread], &chunk);
+    if (!found)
+	return false;
+    *lo = sc->chunk_start[chunk];
+    *hi = sc->chunk_start[chunk+1];
+    return true;
+}
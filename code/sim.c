@@ -24,7 +24,6 @@ static void show_weights(state_t *s) {
     int nid, eid;
     graph_t *g = s->g;
     int nnode = g->nnode;
-    int *neighbor = g->neighbor;
     outmsg("Weights\n");
     for (nid = 0; nid < nnode; nid++) {
 	int eid_start = g->neighbor_start[nid];
@@ -33,7 +32,7 @@ static void show_weights(state_t *s) {
 	compute_sum_weight(s, nid);
 	outmsg("%d: [sum = %.3f]", nid, compute_sum_weight(s, nid));
 	for (eid = eid_start; eid < eid_end; eid++) {
-	    outmsg(" %.3f", compute_weight(s, neighbor[eid]));
+	    outmsg(" %.3f", compute_weight(s, graph_neighbor(g, eid)));
 	}
 	outmsg("\n");
     }
@@ -41,6 +40,206 @@ static void show_weights(state_t *s) {
 #endif
 
 
+/*
+  Neighbor at edge eid, from the 16-bit adjacency lists when narrow is
+  set.  Kernels pass narrow as a constant, so that each width gets its
+  own copy of the loop
+ */
+static inline int neighbor_at(graph_t *g, int eid, bool narrow) {
+    return narrow ? g->neighbor16[eid] : g->neighbor[eid];
+}
+
+static inline void accumulate_range(graph_t *g, int nid, int efirst, bool narrow) {
+    int eid = efirst;
+    int eid_end = g->neighbor_start[nid+1];
+    double sum = g->gsums[eid-1];
+    for (; eid < eid_end; eid++)
+    {
+        //find neighbor's weight in gsum
+        int neighboredge = g->neighbor_start[neighbor_at(g, eid, narrow)];
+        double neighborweights = g->gsums[neighboredge];
+
+        sum += neighborweights;
+        g->gsums[eid] = sum;
+    }
+}
+
+/*
+  Fill in the accumulation of the weights of the node's neighbors,
+  starting at edge efirst.  Sums before efirst are already up to date,
+  and adding in the same order reproduces the full accumulation exactly.
+  The self edge already holds the node's own weight, and it is left
+  alone, since other nodes read it concurrently
+ */
+static inline void accumulate_suffix(graph_t *g, int nid, int efirst) {
+    if (g->neighbor16 != NULL)
+        accumulate_range(g, nid, efirst, true);
+    else
+        accumulate_range(g, nid, efirst, false);
+}
+
+static inline void accumulate_node(graph_t *g, int nid) {
+    accumulate_suffix(g, nid, g->neighbor_start[nid] + 1);
+}
+
+int *find_reverse_edges(graph_t *g) {
+    int *reverse_edge = int_alloc(g->nnode + g->nedge);
+    int nid, eid, reid;
+    if (reverse_edge == NULL)
+        return NULL;
+    for (nid = 0; nid < g->nnode; nid++) {
+        for (eid = g->neighbor_start[nid]; eid < g->neighbor_start[nid+1]; eid++) {
+            int nnid = graph_neighbor(g, eid);
+            int rend = g->neighbor_start[nnid+1];
+            for (reid = g->neighbor_start[nnid]; reid < rend && graph_neighbor(g, reid) != nid; reid++)
+                ;
+            /* Edges of a directed graph may have no reverse */
+            if (reid == rend) {
+                free(reverse_edge);
+                return NULL;
+            }
+            reverse_edge[eid] = reid;
+        }
+    }
+    return reverse_edge;
+}
+
+/* Recompute gsums for nodes [nlo, nhi), based on counts for nodes [wlo, whi) */
+void compute_gsums(state_t *s, int wlo, int whi, int nlo, int nhi) {
+    graph_t *g = s->g;
+    int nid;
+    PROFILE_START(start);
+
+    //for each node, fill in its weight in the self edge index
+#if OMP
+#pragma omp parallel for schedule(static) if (s->nthread > 1) num_threads(s->nthread)
+#endif
+    for (nid = wlo; nid < whi; nid++)
+    {
+        int eid = g->neighbor_start[nid];
+        g->gsums[eid] = compute_weight(s, nid);
+    }
+
+    //for each node fill in the accumulation of the weights of its neighbors
+#if OMP
+    /* Work is proportional to degree, which varies widely on tiled graphs */
+    if (s->sched != NULL) {
+        sched_split(s->sched, nlo, nhi, g->neighbor_start);
+#pragma omp parallel num_threads(s->nthread)
+        {
+            int lo, hi, tid = omp_get_thread_num();
+            while (sched_next(s->sched, tid, &lo, &hi)) {
+                for (nid = lo; nid < hi; nid++)
+                    accumulate_node(g, nid);
+            }
+        }
+        PROFILE_STOP(s, PHASE_GSUMS, start);
+        return;
+    }
+#endif
+    for (nid = nlo; nid < nhi; nid++)
+        accumulate_node(g, nid);
+    PROFILE_STOP(s, PHASE_GSUMS, start);
+}
+
+/*
+  Bring gsums up to date after the counts changed for the dirty nodes.
+  Only nodes in [nlo, nhi) having a dirty node in their adjacency
+  list get accumulated again, starting from the first dirty neighbor.
+  This matters most for high-degree hubs.  Falls back to compute_gsums when many
+  nodes have changed.  With keep set, the dirty nodes stay marked, so
+  that another range can be brought up to date afterward
+ */
+static void refresh_gsums(state_t *s, int wlo, int whi, int nlo, int nhi, bool keep) {
+    graph_t *g = s->g;
+    int ndirty = s->ndirty;
+    int nstale = 0;
+    int i, eid;
+
+    if (ndirty > (whi - wlo) / DIRTY_LIMIT) {
+        if (!keep) {
+            for (i = 0; i < ndirty; i++)
+                s->node_dirty[s->dirty_node[i]] = false;
+            s->ndirty = 0;
+        }
+        compute_gsums(s, wlo, whi, nlo, nhi);
+        return;
+    }
+
+    PROFILE_START(start);
+    //refresh weights of dirty nodes, and find which nodes they affect
+    for (i = 0; i < ndirty; i++) {
+        int nid = s->dirty_node[i];
+        if (!keep)
+            s->node_dirty[nid] = false;
+        g->gsums[g->neighbor_start[nid]] = compute_weight(s, nid);
+        //graph is undirected, so the affected nodes are the neighbors
+        for (eid = g->neighbor_start[nid]; eid < g->neighbor_start[nid+1]; eid++) {
+            int anid = graph_neighbor(g, eid);
+            if (anid < nlo || anid >= nhi)
+                continue;
+            int efirst = s->reverse_edge ? s->reverse_edge[eid] : g->neighbor_start[anid];
+            if (!s->node_stale[anid]) {
+                s->node_stale[anid] = true;
+                s->stale_node[nstale++] = anid;
+                s->stale_from[anid] = efirst;
+            } else if (efirst < s->stale_from[anid])
+                s->stale_from[anid] = efirst;
+        }
+    }
+    if (!keep)
+        s->ndirty = 0;
+
+    for (i = 0; i < nstale; i++) {
+        int nid = s->stale_node[i];
+        int efirst = s->stale_from[nid];
+        s->node_stale[nid] = false;
+        //a change to the node's own weight starts at its first neighbor
+        if (efirst == g->neighbor_start[nid])
+            efirst++;
+        accumulate_suffix(g, nid, efirst);
+    }
+    PROFILE_STOP(s, PHASE_GSUMS, start);
+}
+
+void update_gsums(state_t *s, int wlo, int whi, int nlo, int nhi) {
+    refresh_gsums(s, wlo, whi, nlo, nhi, false);
+}
+
+#if OMP
+/*
+  Count rats with a private histogram for each thread, and then add
+  the histograms together node by node
+ */
+static void count_rats_threaded(state_t *s) {
+    int nnode = s->g->nnode;
+    int nrat = s->nrat;
+    int *rat_position = s->rat_position;
+    int *rat_count = s->rat_count;
+    int *thread_count = s->thread_count;
+
+#pragma omp parallel num_threads(s->nthread)
+    {
+        int nthread = omp_get_num_threads();
+        int *count = thread_count + (size_t) omp_get_thread_num() * nnode;
+        int ri, nid, t;
+        memset(count, 0, nnode * sizeof(int));
+
+#pragma omp for schedule(static)
+        for (ri = 0; ri < nrat; ri++)
+            count[rat_position[ri]]++;
+
+#pragma omp for schedule(static)
+        for (nid = 0; nid < nnode; nid++) {
+            int sum = 0;
+            for (t = 0; t < nthread; t++)
+                sum += thread_count[(size_t) t * nnode + nid];
+            rat_count[nid] = sum;
+        }
+    }
+}
+#endif
+
 /* Recompute all node counts according to rat population */
 void take_census(state_t *s) {
     graph_t *g = s->g;
@@ -49,6 +248,16 @@ void take_census(state_t *s) {
     int *rat_count = s->rat_count;
     int nrat = s->nrat;
 
+    PROFILE_START(start);
+#if OMP
+    if (s->thread_count != NULL) {
+        count_rats_threaded(s);
+        PROFILE_STOP(s, PHASE_CENSUS, start);
+        compute_gsums(s, 0, nnode, 0, nnode);
+        return;
+    }
+#endif
+
     memset(rat_count, 0, nnode * sizeof(int));
 
     //for each rat, look at its position and increment the correct node
@@ -56,42 +265,47 @@ void take_census(state_t *s) {
     for (ri = 0; ri < nrat; ri++) {
         rat_count[rat_position[ri]] ++;
     }
+    PROFILE_STOP(s, PHASE_CENSUS, start);
 
-    //for each node, fill in its weight in the self edge index
-    int nid, eid;
-    for (nid = 0; nid < nnode; nid++)
-    {
-        eid = g->neighbor_start[nid];
-        g->gsums[eid] = compute_weight(s, nid);
-    }
-
-    //for each node fill in the accumulation of the weights of its neighbors
-    for (nid = 0; nid < nnode; nid++)
-    {
-        double sum = 0;
-        for (eid = g->neighbor_start[nid]; eid < g->neighbor_start[nid+1]; eid++)
-        {
-            //find neighbor's weight in gsum
-            int neighboredge = g->neighbor_start[g->neighbor[eid]];
-            double neighborweights = g->gsums[neighboredge];
-
-            sum += neighborweights;
-            g->gsums[eid] = sum;
-        }
-    }
+    compute_gsums(s, 0, nnode, 0, nnode);
 }
 
 
 
 #define NEIGHBORS 16
+/*
+  Number of sums in sums[0, n) not exceeding val, counted without
+  branches.  Since the sums never decrease, this is the position of the
+  first sum above val
+ */
+static inline int count_not_above(double *sums, int n, double val) {
+    int i, count = 0;
+    for (i = 0; i < n; i++)
+        count += sums[i] <= val;
+    return count;
+}
+
+/*
+  Move selection for a node with exactly n entries in its adjacency
+  list.  Called with constant n, so that the comparisons get unrolled.
+  Picks the same neighbor as the searches below.  When rounding makes
+  val reach the total, picks the last neighbor
+ */
+static inline int select_small(graph_t *g, int lo, int n, double val, bool narrow) {
+    int pos = count_not_above(g->gsums + lo, n, val);
+    pos -= pos == n;
+    return neighbor_at(g, lo + pos, narrow);
+}
+
 /*
   Given list of integer counts, generate real-valued weights
-  and use these to flip random coin returning value between 0 and len-1
+  and use these to flip random coin returning value between 0 and len-1.
+  Draw is the rat's next random value in [0.0, 1.0).  Narrow selects
+  the 16-bit adjacency lists
 */
-static inline int next_random_move(state_t *s, int r) {
+static inline int next_random_move(state_t *s, int r, double draw, bool narrow) {
     int nid = s->rat_position[r];
     int nnid = -1;
-    random_t *seedp = &s->rat_seed[r];
 
     //bounds of search
     graph_t *g = s->g;
@@ -101,7 +315,19 @@ static inline int next_random_move(state_t *s, int r) {
     double tsum = g->gsums[hi - 1];
     int eid;
 
-    double val = next_random_float(seedp, tsum);
+    double val = draw * tsum;
+
+    //nearly all nodes have 3-5 neighbors plus the self edge
+    switch (hi - lo) {
+    case 4:
+        return select_small(g, lo, 4, val, narrow);
+    case 5:
+        return select_small(g, lo, 5, val, narrow);
+    case 6:
+        return select_small(g, lo, 6, val, narrow);
+    default:
+        break;
+    }
 
     //half linear search
     if(hi - lo <= NEIGHBORS)
@@ -114,7 +340,7 @@ static inline int next_random_move(state_t *s, int r) {
                 eid--;
                 if (eid == lo) break;
             }
-            return g->neighbor[eid];
+            return neighbor_at(g, eid, narrow);
         } //from beginning
         else {
             eid = lo;
@@ -122,7 +348,7 @@ static inline int next_random_move(state_t *s, int r) {
             {
                 eid++;
             }
-            return g->neighbor[eid];
+            return neighbor_at(g, eid, narrow);
         }
     }
     else
@@ -138,7 +364,7 @@ static inline int next_random_move(state_t *s, int r) {
                 //either it's the first element or its first one strictly
                 // bigger than val
                 if (mid == beg || val >= g->gsums[mid - 1])
-                    return g->neighbor[mid];
+                    return neighbor_at(g, mid, narrow);
 
                 else
                     hi = mid;
@@ -159,29 +385,264 @@ static inline int next_random_move(state_t *s, int r) {
     return nnid;
 }
 
-//TODO: do based on domain
+static inline void move_range(state_t *s, int lo, int hi, bool narrow) {
+    int rid;
+    for (rid = lo; rid < hi; rid++)
+        s->next_rat_position[rid] = next_random_move(s, rid, s->rat_draw[rid], narrow);
+}
+
+/* Compute next positions for rats [lo, hi) from their drawn values */
+static void move_rats(state_t *s, int lo, int hi) {
+    if (s->g->neighbor16 != NULL)
+        move_range(s, lo, hi, true);
+    else
+        move_range(s, lo, hi, false);
+}
+
+/* Draw random values and compute next positions for rats [bstart, bstart+bcount) */
+static void compute_moves(state_t *s, int bstart, int bcount) {
+    int c;
+    int bend = bstart + bcount;
+
+#if OMP
+    /*
+      Searches take longer at high-degree nodes, so threads steal
+      ranges of rats from each other rather than using fixed shares
+     */
+    if (s->sched != NULL && bcount >= THREAD_MIN_BATCH) {
+        sched_split(s->sched, bstart, bend, NULL);
+#pragma omp parallel num_threads(s->nthread) private(c)
+        {
+            int lo, hi, tid = omp_get_thread_num();
+            PROFILE_START(move_start);
+            /* Draw random values for the whole batch, a chunk at a time */
+#pragma omp for schedule(static)
+            for (c = bstart; c < bend; c += RNG_CHUNK) {
+                int ccount = bend - c < RNG_CHUNK ? bend - c : RNG_CHUNK;
+                next_random_floats(s->rat_seed + c, s->rat_draw + c, ccount);
+            }
+
+            while (sched_next(s->sched, tid, &lo, &hi))
+                move_rats(s, lo, hi);
+            PROFILE_STOP(s, PHASE_MOVE, move_start);
+        }
+        return;
+    }
+#endif
+
+    PROFILE_START(move_start);
+    for (c = bstart; c < bend; c += RNG_CHUNK) {
+        int ccount = bend - c < RNG_CHUNK ? bend - c : RNG_CHUNK;
+        next_random_floats(s->rat_seed + c, s->rat_draw + c, ccount);
+    }
+    move_rats(s, bstart, bend);
+    PROFILE_STOP(s, PHASE_MOVE, move_start);
+}
+
+/* Compute next moves for a batch of rats, and then move them */
 static void process_batch(state_t *s, int bstart, int bcount) {
-    graph_t *g = s->g;
-    int rid, nid, eid;
-    int nodes = g->nnode;
+    int rid;
+    /* Small batches only change a few counts */
+    bool incremental = bcount < s->g->nnode;
 
+    compute_moves(s, bstart, bcount);
 
-    for (rid = bstart; rid < bstart + bcount; rid++)
-    {
-        s->next_rat_position[rid] = next_random_move(s, rid);
+    if (!incremental) {
+        PROFILE_START(commit_start);
+#if OMP
+#pragma omp parallel for schedule(static) if (s->nthread > 1) num_threads(s->nthread)
+#endif
+        for (rid = bstart; rid < bstart + bcount; rid++)
+            s->rat_position[rid] = s->next_rat_position[rid];
+        PROFILE_STOP(s, PHASE_COMMIT, commit_start);
+        take_census(s);
+        return;
+    }
+
+    PROFILE_START(start);
+    for (rid = bstart; rid < bstart + bcount; rid++) {
         int onid = s->rat_position[rid];
         int nnid = s->next_rat_position[rid];
+        if (onid == nnid)
+            continue;
+        s->rat_position[rid] = nnid;
+        s->rat_count[onid]--;
+        s->rat_count[nnid]++;
+        mark_dirty(s, onid);
+        mark_dirty(s, nnid);
+    }
+    PROFILE_STOP(s, PHASE_COMMIT, start);
+    update_gsums(s, 0, s->g->nnode, 0, s->g->nnode);
+}
+
+#if MPI
+static inline void move_local_range(state_t *s, int *local_rat, int lo, int hi, bool narrow) {
+    int i;
+    for (i = lo; i < hi; i++) {
+        int rid = local_rat[i];
+        double draw = next_random_float(&s->rat_seed[rid], 1.0);
+        s->next_rat_position[rid] = next_random_move(s, rid, draw, narrow);
+    }
+}
 
+/* Draw random values and compute next positions for local rats [lo, hi) */
+static void move_local_rats(state_t *s, int lo, int hi) {
+    if (s->g->neighbor16 != NULL)
+        move_local_range(s, s->domain->local_rat, lo, hi, true);
+    else
+        move_local_range(s, s->domain->local_rat, lo, hi, false);
+}
+
+/* Compute next positions for local rats [first, last) of the domain */
+static void compute_local_moves(state_t *s, int first, int last) {
+
+#if OMP
+    /*
+      With a thread team in each process, the threads split the moves,
+      and the master thread alone then exchanges the results
+     */
+    if (s->sched != NULL && last - first >= THREAD_MIN_BATCH) {
+        sched_split(s->sched, first, last, NULL);
+#pragma omp parallel num_threads(s->nthread)
+        {
+            int lo, hi, tid = omp_get_thread_num();
+            PROFILE_START(move_start);
+            while (sched_next(s->sched, tid, &lo, &hi))
+                move_local_rats(s, lo, hi);
+            PROFILE_STOP(s, PHASE_MOVE, move_start);
+        }
+        return;
     }
+#endif
+
+    PROFILE_START(move_start);
+    move_local_rats(s, first, last);
+    PROFILE_STOP(s, PHASE_MOVE, move_start);
 }
 
+/*
+  Process batch of rats when nodes are partitioned among processes.
+  Only rats located in this process's block get moved here.  Rats
+  leaving the block are handed off to the neighboring process.
+ */
+static void process_domain_batch(state_t *s, int bstart, int bcount) {
+    domain_t *d = s->domain;
+    int bend = bstart + bcount;
+    int first = d->cursor;
+    int last = first;
+    int i;
+
+    while (last < d->nlocal && d->local_rat[last] < bend)
+        last++;
+
+    compute_local_moves(s, first, last);
+
+    PROFILE_START(commit_start);
+
+    d->nstay = 0;
+    d->nsend_lo = 0;
+    d->nsend_hi = 0;
+    for (i = first; i < last; i++) {
+        int rid = d->local_rat[i];
+        int onid = s->rat_position[rid];
+        int nnid = s->next_rat_position[rid];
+        s->rat_count[onid]--;
+        mark_dirty(s, onid);
+        if (nnid < d->node_lo) {
+            int *t = &d->send_lo[3 * d->nsend_lo++];
+            t[0] = rid; t[1] = nnid; t[2] = (int) s->rat_seed[rid];
+        } else if (nnid >= d->node_hi) {
+            int *t = &d->send_hi[3 * d->nsend_hi++];
+            t[0] = rid; t[1] = nnid; t[2] = (int) s->rat_seed[rid];
+        } else {
+            s->rat_position[rid] = nnid;
+            s->rat_count[nnid]++;
+            mark_dirty(s, nnid);
+            d->stay_rat[d->nstay++] = rid;
+        }
+    }
+    d->cursor = last;
+    PROFILE_STOP(s, PHASE_COMMIT, commit_start);
+
+    PROFILE_START(comm_start);
+    start_exchange_rats(s);
+    PROFILE_STOP(s, PHASE_COMM, comm_start);
+
+    /*
+      Rats arriving & counts from the halo only affect the gsums of
+      boundary rows, so the interior is brought up to date while the
+      messages are in transit
+     */
+    if (d->inner_lo < d->inner_hi)
+        refresh_gsums(s, d->node_lo, d->node_hi, d->inner_lo, d->inner_hi, true);
+
+    PROFILE_START(wait_start);
+    finish_exchange_rats(s);
+    exchange_halo(s);
+    PROFILE_STOP(s, PHASE_COMM, wait_start);
+    refresh_gsums(s, d->halo_lo, d->halo_hi, d->node_lo, d->inner_lo, true);
+    refresh_gsums(s, d->halo_lo, d->halo_hi, d->inner_hi, d->node_hi, false);
+}
+
+/*
+  Process batch of rats when rats are partitioned among processes.
+  Each process moves its own slice of the batch, and then all of them
+  apply the combined changes to the counts
+ */
+static void process_slice_batch(state_t *s, int bstart, int bcount) {
+    int lo, hi, rid;
+    slice_range(s, bstart, bcount, &lo, &hi);
+    compute_moves(s, lo, hi - lo);
+
+    PROFILE_START(comm_start);
+    exchange_deltas(s, bstart, bcount);
+    PROFILE_STOP(s, PHASE_COMM, comm_start);
+
+    PROFILE_START(commit_start);
+    for (rid = lo; rid < hi; rid++)
+        s->rat_position[rid] = s->next_rat_position[rid];
+    PROFILE_STOP(s, PHASE_COMMIT, commit_start);
+    update_gsums(s, 0, s->g->nnode, 0, s->g->nnode);
+}
+#endif
+
 static void run_step(state_t *s, int batch_size) {
     int b, bcount;
     for (b = 0; b < s->nrat; b += batch_size) {
         int rest = s->nrat - b;
         bcount = rest < batch_size ? rest : batch_size;
+#if MPI
+        if (s->domain) {
+            process_domain_batch(s, b, bcount);
+            continue;
+        }
+        if (s->ratpart) {
+            process_slice_batch(s, b, bcount);
+            continue;
+        }
+#endif
         process_batch(s, b, bcount);
     }
+#if MPI
+    if (s->domain)
+        finish_domain_step(s);
+#endif
+}
+
+/* Save state of simulation.  Collective operation when the simulation is partitioned */
+static void checkpoint(state_t *s) {
+#if MPI
+    if (s->domain || s->ratpart) {
+        PROFILE_START(comm_start);
+        if (s->domain)
+            gather_rats(s, s->domain->nlocal, s->domain->local_rat);
+        else
+            gather_rats(s, s->ratpart->nown, s->ratpart->own_rat);
+        PROFILE_STOP(s, PHASE_COMM, comm_start);
+    }
+#endif
+    if (s->checkpointer)
+        write_checkpoint(s);
 }
 
 void simulate(state_t *s, int count, update_t update_mode, int dinterval, bool display) {
@@ -209,23 +670,126 @@ void simulate(state_t *s, int count, update_t update_mode, int dinterval, bool d
         break;
     }
 
-    if (display && mpi_master) {
+    /* Work on simulation state */
+    bool active = mpi_master;
+
+#if PROFILE
+    if (s->profile == NULL)
+        s->profile = new_profile(s->nthread);
+#endif
+    if (s->reverse_edge == NULL) {
+        s->reverse_edge = find_reverse_edges(s->g);
+        if (s->reverse_edge == NULL)
+            outmsg("Couldn't find reverse edges.  Accumulating whole adjacency lists\n");
+    }
+    narrow_graph(s->g);
+#if OMP
+    if (s->nthread > 1 && s->thread_count == NULL) {
+        s->thread_count = int_alloc((size_t) s->nthread * s->g->nnode);
+        s->sched = new_sched(s->nthread);
+        if (s->thread_count == NULL || s->sched == NULL) {
+            outmsg("Couldn't allocate thread counts.  Using 1 thread\n");
+            free(s->thread_count);
+            s->thread_count = NULL;
+            if (s->sched)
+                free_sched(s->sched);
+            s->sched = NULL;
+            s->nthread = 1;
+        }
+    }
+#endif
+#if MPI
+    /*
+      Rat-order mode would require communicating after every rat,
+      and so it runs entirely on the master.
+     */
+    if (s->nprocess > 1 && update_mode != UPDATE_RAT && s->partition == PARTITION_RATS) {
+        s->ratpart = new_ratpart(s, batch_size);
+        active = true;
+    } else if (s->nprocess > 1 && update_mode != UPDATE_RAT) {
+        s->domain = new_domain(s, batch_size);
+        active = true;
+    }
+#endif
+
+    if (s->checkpoint_name && mpi_master)
+        s->checkpointer = new_checkpointer(s, s->checkpoint_name);
+
+    /* Hash formats replace the output stream with one hash per step */
+    bool hashing = display &&
+        (s->output_format == OUTPUT_HASH || s->output_format == OUTPUT_HASH_RATS);
+    if (display && mpi_master && !hashing) {
+	    /* Format & write output while simulation continues */
+	    s->writer = new_writer(s, s->output_format);
 	    show(s, show_counts);
     }
 #if DEBUG
     show_weights(s);
 #endif
 
-    for (i = 0; i < count; i++) {
+    if (!active)
+        return;
+    if (hashing)
+        show_hash(s);
+
+    /* Resumed simulations continue from their checkpoint */
+    for (i = s->step; i < count; i++) {
 
         run_step(s, batch_size);
+        s->step = i+1;
 
-        if (display && mpi_master) {
+        if (hashing) {
+            PROFILE_START(output_start);
+            show_hash(s);
+            PROFILE_STOP(s, PHASE_OUTPUT, output_start);
+        } else if (display) {
             show_counts = (((i+1) % dinterval) == 0) || (i == count-1);
-            show(s, show_counts);
+#if MPI
+            if (show_counts && s->domain) {
+                PROFILE_START(comm_start);
+                gather_counts(s);
+                PROFILE_STOP(s, PHASE_COMM, comm_start);
+            }
+#endif
+            if (mpi_master) {
+                PROFILE_START(output_start);
+                show(s, show_counts);
+                PROFILE_STOP(s, PHASE_OUTPUT, output_start);
+            }
+        }
+        if (s->checkpoint_name && (s->step == count ||
+            (s->checkpoint_interval > 0 && s->step % s->checkpoint_interval == 0)))
+            checkpoint(s);
+#if MPI
+        if (s->domain && s->rebalance_interval > 0 && s->step % s->rebalance_interval == 0
+            && s->step < count) {
+            PROFILE_START(comm_start);
+            rebalance_domain(s);
+            PROFILE_STOP(s, PHASE_COMM, comm_start);
         }
+#endif
+    }
+    if (display && mpi_master) {
+	    PROFILE_START(output_start);
+	    if (s->writer)
+		finish_writer(s);
+	    else
+		done();
+	    PROFILE_STOP(s, PHASE_OUTPUT, output_start);
+    }
+    if (s->checkpointer) {
+        free_checkpointer(s->checkpointer);
+        s->checkpointer = NULL;
+    }
+#if MPI
+    if (s->domain) {
+        free_domain(s->domain);
+        s->domain = NULL;
     }
-    if (display && mpi_master)
-	    done();
+    if (s->ratpart) {
+        free_ratpart(s->ratpart);
+        s->ratpart = NULL;
+    }
+#endif
 }
 
@@ -1,3 +1,8 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
 #include "crun.h"
 
 void outmsg(char *fmt, ...) {
@@ -22,9 +27,97 @@ double *double_alloc(size_t n) {
     return (double *) calloc(n, sizeof(double));
 }
 
+/* Allocate n bools and clear them. */
+static bool *bool_alloc(size_t n) {
+    return (bool *) calloc(n, sizeof(bool));
+}
+
+/*
+  Large arrays get their own mappings, aligned to huge pages and
+  advised to be backed by them.  Pages are left untouched, so that
+  each one gets placed on the NUMA node of the thread writing it
+  first, unless interleaving is requested.
+ */
+#define HUGE_PAGE (2UL * 1024 * 1024)
+#define HUGE_ROUND(n) (((n) + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1))
+/* From linux/mempolicy.h */
+#define MPOL_INTERLEAVE 3
+
+static bool interleave = false;
+static size_t large_bytes = 0;
+static int large_count = 0;
+
+/* Spread pages of large arrays across all NUMA nodes */
+void set_interleave(bool on) {
+    interleave = on;
+}
+
+/* Allocate n zeroed elements of given size.  Free with page_free */
+void *page_alloc(size_t n, size_t size) {
+    size_t len = HUGE_ROUND(n * size);
+    if (n * size < HUGE_PAGE)
+	return calloc(n, size);
+    /* Map extra huge page, and then trim to aligned region */
+    char *map = mmap(NULL, len + HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+	return NULL;
+    char *start = (char *) HUGE_ROUND((uintptr_t) map);
+    if (start > map)
+	munmap(map, start - map);
+    if (start + len < map + len + HUGE_PAGE)
+	munmap(start + len, map + len + HUGE_PAGE - (start + len));
+#ifdef MADV_HUGEPAGE
+    madvise(start, len, MADV_HUGEPAGE);
+#endif
+    if (interleave) {
+	unsigned long nodes = ~0UL;
+	if (syscall(SYS_mbind, start, len, MPOL_INTERLEAVE, &nodes, 8 * sizeof(nodes), 0) != 0) {
+	    outmsg("WARNING: Couldn't interleave memory across NUMA nodes\n");
+	    interleave = false;
+	}
+    }
+    large_bytes += len;
+    large_count++;
+    return start;
+}
+
+void page_free(void *p, size_t n, size_t size) {
+    if (p == NULL)
+	return;
+    if (n * size < HUGE_PAGE) {
+	free(p);
+	return;
+    }
+    munmap(p, HUGE_ROUND(n * size));
+    large_bytes -= HUGE_ROUND(n * size);
+    large_count--;
+}
+
+/* Report memory in large arrays, and how much of it huge pages hold */
+void report_memory() {
+    char linebuf[MAXLINE];
+    long huge_kb = -1;
+    FILE *infile = fopen("/proc/self/smaps_rollup", "r");
+    while (infile != NULL && fgets(linebuf, MAXLINE, infile) != NULL) {
+	if (sscanf(linebuf, "AnonHugePages: %ld", &huge_kb) == 1)
+	    break;
+    }
+    if (infile != NULL)
+	fclose(infile);
+    if (large_count == 0)
+	return;
+    if (huge_kb < 0)
+	outmsg("Memory: %.1f MB in %d large arrays%s\n", large_bytes / 1048576.0, large_count,
+	       interleave ? ", interleaved across NUMA nodes" : "");
+    else
+	outmsg("Memory: %.1f MB in %d large arrays, %.1f MB on huge pages%s\n",
+	       large_bytes / 1048576.0, large_count, huge_kb / 1024.0,
+	       interleave ? ", interleaved across NUMA nodes" : "");
+}
+
 /* Allocate n random number seeds and zero them out.  */
 static random_t *rt_alloc(size_t n) {
-    return (random_t *) calloc(n, sizeof(random_t));
+    return (random_t *) page_alloc(n, sizeof(random_t));
 }
 
 
@@ -42,7 +135,26 @@ state_t *new_rats(graph_t *g, int nrat, random_t global_seed) {
     s->nrat = nrat;
     s->nprocess = 1;
     s->process_id = 0;
+    s->nthread = 1;
+    s->thread_count = NULL;
+    s->sched = NULL;
     s->global_seed = global_seed;
+    s->step = 0;
+    s->checkpoint_name = NULL;
+    s->checkpoint_interval = 0;
+    s->checkpointer = NULL;
+    s->profile = NULL;
+    s->output_format = OUTPUT_TEXT;
+    s->writer = NULL;
+    s->map = NULL;
+    s->map_len = 0;
+    s->output_depth = OUTPUT_DEPTH;
+    s->partition = PARTITION_NODES;
+    s->rebalance_interval = REBALANCE_INTERVAL;
+#if MPI
+    s->domain = NULL;
+    s->ratpart = NULL;
+#endif
     s->load_factor = (double) nrat / nnode;
 
     /* Compute batch size as max(BATCH_FRACTION * R, sqrt(R)) */
@@ -56,16 +168,30 @@ state_t *new_rats(graph_t *g, int nrat, random_t global_seed) {
 
     // Allocate data structures
     bool ok = true;
-    s->rat_position = int_alloc(nrat);
+    s->rat_position = (int *) page_alloc(nrat, sizeof(int));
     ok = ok && s->rat_position != NULL;
-    s->next_rat_position = int_alloc(nrat);
+    s->next_rat_position = (int *) page_alloc(nrat, sizeof(int));
     ok = ok && s->next_rat_position != NULL;
     s->rat_seed = rt_alloc(nrat);
     ok = ok && s->rat_seed != NULL;
-    s->rat_count = int_alloc(nnode);
+    s->rat_draw = (double *) page_alloc(nrat, sizeof(double));
+    ok = ok && s->rat_draw != NULL;
+    s->rat_count = (int *) page_alloc(nnode, sizeof(int));
     ok = ok && s->rat_count != NULL;
     s->pre_computed = malloc((s->nrat + 1) * sizeof(double));
     ok = ok && s->pre_computed != NULL;
+    s->ndirty = 0;
+    s->dirty_node = int_alloc(nnode);
+    ok = ok && s->dirty_node != NULL;
+    s->node_dirty = bool_alloc(nnode);
+    ok = ok && s->node_dirty != NULL;
+    s->stale_node = int_alloc(nnode);
+    ok = ok && s->stale_node != NULL;
+    s->node_stale = bool_alloc(nnode);
+    ok = ok && s->node_stale != NULL;
+    s->stale_from = int_alloc(nnode);
+    ok = ok && s->stale_from != NULL;
+    s->reverse_edge = NULL;
 
     if (!ok) {
 	outmsg("Couldn't allocate space for %d rats", nrat);
@@ -75,6 +201,29 @@ state_t *new_rats(graph_t *g, int nrat, random_t global_seed) {
     return s;
 }
 
+void free_rats(state_t *s) {
+    if (s->map != NULL)
+	munmap(s->map, s->map_len);
+    else
+	page_free(s->rat_position, s->nrat, sizeof(int));
+    page_free(s->next_rat_position, s->nrat, sizeof(int));
+    page_free(s->rat_seed, s->nrat, sizeof(random_t));
+    page_free(s->rat_draw, s->nrat, sizeof(double));
+    page_free(s->rat_count, s->g->nnode, sizeof(int));
+    free(s->pre_computed);
+    free(s->dirty_node);
+    free(s->node_dirty);
+    free(s->stale_node);
+    free(s->node_stale);
+    free(s->stale_from);
+    free(s->reverse_edge);
+    free(s->thread_count);
+    if (s->sched != NULL)
+	free_sched(s->sched);
+    free(s->profile);
+    free(s);
+}
+
 /* Set seed values for the rats.  Maybe you could use multiple threads ... */
 static void seed_rats(state_t *s) {
     random_t global_seed = s->global_seed;
@@ -88,6 +237,18 @@ static void seed_rats(state_t *s) {
     }
 }
 
+/* Seed the rats and tabulate weights once the rat positions are known */
+void init_rats(state_t *s) {
+    //calculate pre-computed mweights
+    int i;
+    for(i = 0; i <= s->nrat; i++)
+    {
+        s->pre_computed[i] = mweight((double) i/s->load_factor);
+    }
+
+    seed_rats(s);
+}
+
 /* See whether line of text is a comment */
 static inline bool is_comment(char *s) {
     int i;
@@ -100,10 +261,85 @@ static inline bool is_comment(char *s) {
     return false;
 }
 
+/* Map rat positions from binary file */
+static state_t *map_rats(graph_t *g, FILE *infile, random_t global_seed) {
+    binary_header_t h;
+    struct stat st;
+    int r;
+
+    rewind(infile);
+    if (fread(&h, sizeof(h), 1, infile) != 1 || h.magic != RATS_MAGIC) {
+	outmsg("ERROR. Not a binary rat file\n");
+	return NULL;
+    }
+    if (h.version != BINARY_VERSION || h.nrat < 0) {
+	outmsg("ERROR. Malformed binary rat file header\n");
+	return NULL;
+    }
+    if (h.nnode != g->nnode) {
+	outmsg("Graph contains %d nodes, but rat file has %d\n", g->nnode, h.nnode);
+	return NULL;
+    }
+    size_t len = sizeof(h) + (size_t) h.nrat * sizeof(int);
+    if (fstat(fileno(infile), &st) != 0 || (size_t) st.st_size < len) {
+	outmsg("ERROR. Binary rat file truncated\n");
+	return NULL;
+    }
+    /* Private mapping, so that positions can be updated in place */
+    void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(infile), 0);
+    if (map == MAP_FAILED) {
+	outmsg("ERROR. Couldn't map binary rat file\n");
+	return NULL;
+    }
+    state_t *s = new_rats(g, h.nrat, global_seed);
+    if (s == NULL) {
+	munmap(map, len);
+	return NULL;
+    }
+    page_free(s->rat_position, s->nrat, sizeof(int));
+    s->rat_position = (int *) ((char *) map + sizeof(h));
+    s->map = map;
+    s->map_len = len;
+    for (r = 0; r < s->nrat; r++) {
+	int nid = s->rat_position[r];
+	if (nid < 0 || nid >= g->nnode) {
+	    outmsg("ERROR.  Rat %d.  Invalid node number %d\n", r, nid);
+	    free_rats(s);
+	    return NULL;
+	}
+    }
+
+    init_rats(s);
+    outmsg("Mapped %d rats\n", s->nrat);
+    return s;
+}
+
+/* Write positions of nrat rats on graph with nnode nodes in binary format */
+bool write_positions(int nnode, int nrat, int *rat_position, FILE *outfile) {
+    binary_header_t h;
+    memset(&h, 0, sizeof(h));
+    h.magic = RATS_MAGIC;
+    h.version = BINARY_VERSION;
+    h.nnode = nnode;
+    h.nrat = nrat;
+    return fwrite(&h, sizeof(h), 1, outfile) == 1
+	&& fwrite(rat_position, sizeof(int), nrat, outfile) == (size_t) nrat;
+}
+
+/* Write rat positions in binary format */
+bool write_rats(state_t *s, FILE *outfile) {
+    return write_positions(s->g->nnode, s->nrat, s->rat_position, outfile);
+}
+
 /* Read in rat file */
 state_t *read_rats(graph_t *g, FILE *infile, random_t global_seed) {
     char linebuf[MAXLINE];
     int r, nnode, nid, nrat;
+    uint32_t magic;
+
+    if (fread(&magic, sizeof(magic), 1, infile) == 1 && magic == RATS_MAGIC)
+	return map_rats(g, infile, global_seed);
+    rewind(infile);
 
     // Read header information
     while (fgets(linebuf, MAXLINE, infile) != NULL) {
@@ -138,26 +374,38 @@ state_t *read_rats(graph_t *g, FILE *infile, random_t global_seed) {
 	s->rat_position[r] = nid;
     }
 
-    //calculate pre-computed mweights
-    int i;
-    for(i = 0; i <= s->nrat; i++)
-    {
-        s->pre_computed[i] = mweight((double) i/s->load_factor);
-    }
-
-    seed_rats(s);
+    init_rats(s);
     outmsg("Loaded %d rats\n", nrat);
     return s;
 }
 
-/* print state of nodes */
+/* Convert rat positions to match renumbered graph */
+void reorder_rats(state_t *s) {
+    int *node_rank = s->g->node_rank;
+    int r;
+    if (node_rank == NULL)
+	return;
+    for (r = 0; r < s->nrat; r++)
+	s->rat_position[r] = node_rank[s->rat_position[r]];
+}
+
+/* print state of nodes, using original node numbering */
 void show(state_t *s, bool show_counts) {
     int nid;
     graph_t *g = s->g;
+    if (s->writer != NULL) {
+	write_step(s, show_counts);
+	return;
+    }
     printf("STEP %d %d\n", g->nnode, s->nrat);
     if (show_counts) {
+	if (g->node_rank != NULL) {
+	    for (nid = 0; nid < g->nnode; nid++)
+		printf("%d\n", s->rat_count[g->node_rank[nid]]);
+	} else {
 	    for (nid = 0; nid < g->nnode; nid++)
 		printf("%d\n", s->rat_count[nid]);
+	}
     }
     printf("END\n");
 }